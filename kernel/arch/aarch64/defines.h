@@ -4,6 +4,13 @@
 #define LOG_PAGE_SIZE 12
 #define PAGE_SIZE (1 << LOG_PAGE_SIZE)
 
+// the smallest block vmap_range can map with one descriptor, when va and pa are both aligned to it.
+#define HUGE_PAGE_SIZE (1 << 21)
+
+// the longest range vmap_prepare always takes on: wherever it starts, 16 blocks touch at most 17
+// level 3 tables and 2 of each level above, well within the table reserve.
+#define VMAP_PREPARE_MAX_PAGES (16 * HUGE_PAGE_SIZE / PAGE_SIZE)
+
 #define KERNEL_VIRT_BEGIN 0xffff000000000000
 
 // Leave 4 GiB (2^32) for kernel and initialization stuff
@@ -20,6 +27,14 @@
 // 8 TiB permanent heap (2^43).
 #define KERNEL_PERMANENT_HEAP_END (KERNEL_PERMANENT_HEAP_BEGIN + 0x80000000000)
 
+// all of physical memory is mapped at DIRECT_MAP_BEGIN + pa. 32 TiB (2^45), up to the recursive
+// mapping.
+#define DIRECT_MAP_BEGIN 0xffff400000000000
+#define DIRECT_MAP_END 0xffff600000000000
+
+// per-cpu stack the synchronous exception vector switches to (kept in sp_el0).
+#define EXCEPTION_STACK_SIZE (2 * PAGE_SIZE)
+
 // 192 gives access to tables via 0xffff600000000000 through 0xffff607fffffffff
 #define RECURSIVE_INDEX 192
 
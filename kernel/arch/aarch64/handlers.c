@@ -1,6 +1,10 @@
 #include "macros.h"
+#include "cpu.h"
 #include "interrupts.h"
 #include "kconsole.h"
+#include "kstack.h"
+#include "pltfrm.h"
+#include "sched.h"
 
 typedef enum {
     EC_UNKNOWN = 0x0,
@@ -26,13 +30,56 @@ typedef enum {
     EC_BRK_INSTR = 0x3c,
 } ExceptionClass;
 
+// data fault status codes 0b0001LL: translation fault at level LL.
+#define DFSC_TRANSLATION_MASK 0x3c
+#define DFSC_TRANSLATION 0x04
+
+// FAR_EL1 isn't valid.
+#define ESR_FNV (1 << 10)
+
+// the vector saves here instead of __pcpu_min_context, see fault_save_context.
+PERCPU_UNINIT struct regs __pcpu_fault_context;
+
+static PERCPU_UNINIT uint8_t __pcpu_exception_stack[EXCEPTION_STACK_SIZE]
+    __attribute__((aligned(16)));
+
+// used by every cpu until it has a percpu area.
+uint8_t boot_exception_stack[EXCEPTION_STACK_SIZE] __attribute__((aligned(16)));
+
+void install_exception_stack(void) {
+    uintptr_t top = (uintptr_t)ADDRESS_PERCPU(__pcpu_exception_stack) + EXCEPTION_STACK_SIZE;
+    asm volatile("msr sp_el0, %0" ::"r"(top));
+}
+
 static uint64_t esr_el1_read(void);
 
-void kernel_ehandler(void) {
-    kprint("We're in the exception handler!\n");
+// returns true if the fault was fixed and the faulting instruction can be retried.
+static bool fixup_fault(uint64_t syndrome) {
+    ExceptionClass ex_cls = (syndrome >> 26) & 0x3f;
 
+    if (ex_cls != EC_DATA_ABRT || (syndrome & ESR_FNV)) {
+        return false;
+    }
+
+    if ((syndrome & DFSC_TRANSLATION_MASK) != DFSC_TRANSLATION) {
+        return false;
+    }
+
+    uint64_t far;
+    asm volatile("mrs %0, far_el1\n" : "=r"(far));
+
+    return kstack_grow(far);
+}
+
+void kernel_ehandler(void) {
     uint64_t syndrome = esr_el1_read();
 
+    if (fixup_fault(syndrome)) {
+        return;
+    }
+
+    kprint("We're in the exception handler!\n");
+
     kprint("The syndrome register contains: 0x%lx\n", syndrome);
 
     ExceptionClass ex_cls = (syndrome >> 26) & 0x3f;
@@ -98,6 +145,10 @@ void irq_handler(void) {
 
     void dispatch_irq(intid_t intid);
     dispatch_irq(intid);
+
+    // the handler may have woken something that should run now. handlers end their own intid, so
+    // it's fine to switch away from here.
+    sched_kicked();
 }
 
 /* Utils */
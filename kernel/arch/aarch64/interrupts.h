@@ -36,6 +36,9 @@ void mask_irqs(void);
 void unmask_irqs(void);
 void restore_irq_mask(int val);
 
+// points sp_el0 at this cpu's exception stack. call once the percpu area is set up.
+void install_exception_stack(void);
+
 bool is_private_interrupt(intid_t intid); 
 bool is_global_interrupt(intid_t intid); 
 
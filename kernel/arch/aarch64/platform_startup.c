@@ -12,6 +12,7 @@
 #include "gic.h"
 #include "interrupts.h"
 #include "kmalloc.h"
+#include "kstack.h"
 #include "kvmalloc.h"
 #include "macros.h"
 #include "memory.h"
@@ -247,18 +248,12 @@ void setup_interrupts(void) {
     uint64_t gicr_base, gicr_size;
     data = read_reg(data, ac, sc, &gicr_base, &gicr_size);
 
-    uint64_t gicd_pages = (gicd_size + PAGE_SIZE - 1) / PAGE_SIZE;
-    uint64_t gicr_pages = (gicr_size + PAGE_SIZE - 1) / PAGE_SIZE;
+    gicd_base_ptr = (uintptr_t)ioremap(gicd_base, gicd_size);
+    gicr_base_ptr = (uintptr_t)ioremap(gicr_base, gicr_size);
 
-    uint64_t total_pages = gicd_pages + gicr_pages;
-
-    void *base = kvmalloc(total_pages, KVMALLOC_PERMANENT);
-    gicd_base_ptr = (uintptr_t)base;
-    gicr_base_ptr = gicd_base_ptr + gicd_pages * PAGE_SIZE;
-    vmap_range(gicd_base_ptr, gicd_base, gicd_pages, PROT_RSYS | PROT_WSYS,
-               MEMORY_TYPE_DEVICE_STRICT, 0);
-    vmap_range(gicr_base_ptr, gicr_base, gicr_pages, PROT_RSYS | PROT_WSYS,
-               MEMORY_TYPE_DEVICE_STRICT, 0);
+    if (!gicd_base_ptr || !gicr_base_ptr) {
+        KFATAL("Failed to map the GIC.\n");
+    }
 
     cpu_setup_interrupts();
 
@@ -267,40 +262,14 @@ void setup_interrupts(void) {
     dsb_isb();
 }
 
-void *percpu_copy(void) {
-    extern char __percpu_begin, __percpu_end;
-    uintptr_t percpu_begin = (uintptr_t)&__percpu_begin;
-    uintptr_t percpu_end = (uintptr_t)&__percpu_end;
-    size_t pages =
-        (percpu_end - percpu_begin + PAGE_SIZE - 1) & ~(size_t)(PAGE_SIZE - 1);
-    void *ptr = kvmalloc(pages, KVMALLOC_PERMANENT);
-
-    extern uintptr_t map_percpu(uintptr_t base);
-    map_percpu((uintptr_t)ptr);
-
-    return ptr;
-}
+void *percpu_copy(void);
 
 void *alloc_stack(void) {
-    size_t pages = (KSTACK_SIZE + PAGE_SIZE - 1) / PAGE_SIZE;
-    void *ptr = kvmalloc(pages, KVMALLOC_PERMANENT);
-
-    for (size_t i = 0; i < pages; i++) {
-        uintptr_t reg;
-        int r = global_acquire_pages(1, &reg, NULL);
-        if (r == -1) {
-            KFATAL("Failed to allocate seconary cpu stack.\n");
-        }
-
-        r = vmap((uintptr_t)ptr + i * PAGE_SIZE, reg, PROT_RSYS | PROT_WSYS,
-                 MEMORY_TYPE_NORMAL, 0);
+    // nothing to grow these for us, they have no task.
+    uintptr_t base = kstack_alloc();
+    kstack_populate(base, KSTACK_PAGES);
 
-        if (r < 0) {
-            KFATAL("Failed to map stack memory.\n");
-        }
-    }
-
-    return ptr + KSTACK_SIZE;
+    return (void *)(base + KSTACK_SIZE);
 }
 
 ctdn_latch_t startup_latch;
@@ -397,10 +366,13 @@ void wfi_loop(void);
 
 
 void platform_startup(void) {
+    install_exception_stack();
+
+    // just a peek at the header from this cpu, which no other cpu needs to hear about.
     struct fdt_header *header = kvmalloc(1, 0);
 
     int r = vmap((uintptr_t)header, (uintptr_t)fdt_header_phys, PROT_RSYS,
-                 MEMORY_TYPE_NON_CACHEABLE, 0);
+                 MEMORY_TYPE_NON_CACHEABLE, VMAP_FLAG_PRIVATE);
     if (r < 0) {
         KFATAL("vmap failed: %d\n", r);
     }
@@ -422,11 +394,8 @@ void platform_startup(void) {
     // otherwise our physical memory allocator might allocate it.
     fdt_header = kvmalloc(total_pages, KVMALLOC_PERMANENT);
 
-    for (uint32_t i = 0; i < total_pages; i++) {
-        vmap((uintptr_t)fdt_header + i * PAGE_SIZE,
-             (uintptr_t)fdt_header_phys + i * PAGE_SIZE, PROT_RSYS,
-             MEMORY_TYPE_NON_CACHEABLE, 0);
-    }
+    vmap_range((uintptr_t)fdt_header, (uintptr_t)fdt_header_phys, total_pages,
+               PROT_RSYS, MEMORY_TYPE_NON_CACHEABLE, 0);
 
     build_rdt();
 
@@ -464,6 +433,7 @@ void platform_startup(void) {
 
     setup_interrupts();
     setup_sgis();
+    sched_init_cpu();
 
     bring_up_secondary();
 
@@ -479,14 +449,16 @@ void platform_basic_init();
 void secondary_main(void *pcpu_start) {
     platform_basic_init();
     set_percpu_start(pcpu_start);
+    install_exception_stack();
 
     cpu_setup_interrupts();
     setup_sgis();
+    sched_init_cpu();
 
     ctdn_latch_decrement(&startup_latch);
 
-    wfi_loop();
-    // timer_start();
+    // the tick is what lets an idle secondary pull work from the busier cpus.
+    timer_start();
 }
 
 void platform_basic_init(void) {
@@ -23,6 +23,7 @@ static void sched_sgi_handler(intid_t intid, void *context) {
 
     switch (payload->message_type) {
         case SCHED_MESSAGE_NONE:
+        case SCHED_MESSAGE_RESCHEDULE:
             do_unpin = false;
             dec_task = false;
             break;
@@ -9,6 +9,8 @@
 #define SCHED_MESSAGE_READY_TASK 1
 #define SCHED_MESSAGE_SUSPEND_TASK 2
 #define SCHED_MESSAGE_BLOCK_TASK 3
+// no task: wakes an idle cpu so that it looks for work.
+#define SCHED_MESSAGE_RESCHEDULE 4
 
 struct sched_sgi_payload {
     int message_type;
@@ -58,7 +58,6 @@ time_t timer_get_phys(void) {
     return val;
 }
 
-#define TIME_SLICE() (timer_gethz() / HZ)
 #define TIMER_INTID() ((intid_t)30)
 
 static PERCPU_UNINIT struct timer_context {
@@ -70,18 +69,30 @@ PERCPU_UNINIT struct regs __pcpu_min_context;
 void wfi_loop(void) {
     while (1) {
         asm volatile("wfi");
-        kprint("We were interrupted. (cpu %u)\n", this_cpu());
     }
 }
 
-static void begin_slice(void) { timer_set_counter(TIME_SLICE()); }
+static void begin_slice(void) { timer_set_counter(sched_slice()); }
+
+void timer_tick_resume(void) {
+    if (!(cntp_ctl_el0_read() & 1)) {
+        begin_slice();
+        timer_enable();
+    }
+}
 
 void no_save_switch_to(struct task *task) {
+    // the outgoing task's registers have been saved by now, so it may run elsewhere.
+    if (current_task && current_task != task) {
+        __atomic_store_n(&current_task->on_cpu, false, __ATOMIC_RELEASE);
+    }
+
     current_task = task;
 
     struct regs *regs, local_regs;
 
     if (task) {
+        __atomic_store_n(&task->on_cpu, true, __ATOMIC_RELAXED);
         regs = &task->cpu_regs;
         update_state(task, TASK_STATE_RUNNING);
     } else {
@@ -94,7 +105,17 @@ void no_save_switch_to(struct task *task) {
     // TODO: Restore fp_regs and extra_regs.
 
     [[noreturn]] void restore_then_eret(uint64_t orig_sp_el1, struct regs *regs);
-    begin_slice();
+
+    if (sched_tick_needed()) {
+        begin_slice();
+        timer_enable();
+    } else {
+        // nothing to preempt and no other deadline to wait for, so don't tick at all. a
+        // SCHED_MESSAGE_RESCHEDULE brings us back. the running task's runtime is accounted when
+        // it next changes state, as always.
+        timer_disable();
+    }
+
     restore_then_eret(min_context.sp, regs);
 }
 
@@ -130,6 +151,10 @@ static void timer_handler(void *ctx, intid_t intid) {
 
     ++tctx->count;
 
+    if (tctx->count % SCHED_BALANCE_TICKS == 0) {
+        sched_balance();
+    }
+
     timer_handle();
 }
 
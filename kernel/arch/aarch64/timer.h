@@ -9,6 +9,9 @@ void timer_start(void);
 void timer_enable(void);
 void timer_disable(void);
 
+// restarts a stopped tick with a fresh slice. does nothing if it's running.
+void timer_tick_resume(void);
+
 time_t timer_get_phys(void);
 
 void timer_set_imask(void);
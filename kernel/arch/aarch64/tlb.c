@@ -0,0 +1,154 @@
+#include "types.h"
+#include "macros.h"
+#include "./pltfrm.h"
+
+#include "vmap.h"
+
+#if PAGE_SIZE != 4096
+#error Unimplemented
+#endif
+
+// past this many pages, a single vmalle1os is cheaper than invalidating the range.
+#define TLB_FLUSH_RANGE_MAX_PAGES 512
+
+#define TLBI_TG_4KB 1ULL
+
+void tlbi_va(uint64_t operand);
+void tlbi_range(uint64_t operand);
+void tlbi_va_local(uint64_t operand);
+void tlbi_range_local(uint64_t operand);
+void tlbi_all_local(void);
+
+// -1 until we've read ID_AA64ISAR0_EL1.
+static int has_range_tlbi = -1;
+
+static bool range_tlbi_supported(void) {
+    if (has_range_tlbi == -1) {
+        uint64_t isar0;
+        asm volatile("mrs %0, id_aa64isar0_el1" : "=r"(isar0));
+
+        // TLB == 0b0010 means both the outer-shareable and the range instructions are implemented.
+        has_range_tlbi = EXTRACT(isar0, 59, 56) >= 2;
+    }
+
+    return has_range_tlbi;
+}
+
+// -1 until we've read ID_AA64MMFR2_EL1.
+static int has_ttl = -1;
+
+static bool ttl_supported(void) {
+    if (has_ttl == -1) {
+        uint64_t mmfr2;
+        asm volatile("mrs %0, id_aa64mmfr2_el1" : "=r"(mmfr2));
+
+        has_ttl = EXTRACT(mmfr2, 51, 48) >= 1;
+    }
+
+    return has_ttl;
+}
+
+static uint64_t va_operand(uintptr_t va) {
+    return EXTRACT(va, 55, LOG_PAGE_SIZE);
+}
+
+// covers (num + 1) * 2^(5 * scale + 1) pages starting at va.
+static uint64_t range_operand(uintptr_t va, uint64_t scale, uint64_t num) {
+    uint64_t operand = EXTRACT(va, 48, LOG_PAGE_SIZE);
+    operand |= num << 39;
+    operand |= scale << 44;
+    operand |= TLBI_TG_4KB << 46;
+    return operand;
+}
+
+void tlb_flush_addr_level(uintptr_t va, int level) {
+    uint64_t operand = va_operand(va);
+
+    // TTL: the granule in bits [47:46], the level of the leaf entry in [45:44].
+    if (level > 0 && ttl_supported()) {
+        operand |= (TLBI_TG_4KB << 2 | level) << 44;
+    }
+
+    asm volatile("dsb ishst" ::: "memory");
+    tlbi_va(operand);
+    asm volatile("dsb ish\nisb" ::: "memory");
+}
+
+// local: only this cpu's tlb, which needs only non-shareable barriers.
+static void flush_range(uintptr_t va, size_t pages, bool local) {
+    if (pages > TLB_FLUSH_RANGE_MAX_PAGES) {
+        if (!local) {
+            tlb_flush();
+            return;
+        }
+
+        asm volatile("dsb nshst" ::: "memory");
+        tlbi_all_local();
+        asm volatile("dsb nsh\nisb" ::: "memory");
+        return;
+    }
+
+    bool range = range_tlbi_supported();
+
+    if (local) {
+        asm volatile("dsb nshst" ::: "memory");
+    } else {
+        asm volatile("dsb ishst" ::: "memory");
+    }
+
+    uint64_t scale = 0;
+
+    while (pages) {
+        // a range operation always covers an even number of pages.
+        if (!range || pages % 2 == 1) {
+            if (local) {
+                tlbi_va_local(va_operand(va));
+            } else {
+                tlbi_va(va_operand(va));
+            }
+
+            va += PAGE_SIZE;
+            pages--;
+            continue;
+        }
+
+        uint64_t shift = 5 * scale + 1;
+        uint64_t chunks = (pages >> shift) & 0x1f;
+
+        if (chunks) {
+            uint64_t operand = range_operand(va, scale, chunks - 1);
+
+            if (local) {
+                tlbi_range_local(operand);
+            } else {
+                tlbi_range(operand);
+            }
+
+            size_t covered = chunks << shift;
+            va += covered * PAGE_SIZE;
+            pages -= covered;
+        }
+
+        scale++;
+    }
+
+    if (local) {
+        asm volatile("dsb nsh\nisb" ::: "memory");
+    } else {
+        asm volatile("dsb ish\nisb" ::: "memory");
+    }
+}
+
+void tlb_flush_range(uintptr_t va, size_t pages) {
+    flush_range(va, pages, false);
+}
+
+void tlb_flush_range_local(uintptr_t va, size_t pages) {
+    flush_range(va, pages, true);
+}
+
+void tlb_flush_addr_local(uintptr_t va) {
+    asm volatile("dsb nshst" ::: "memory");
+    tlbi_va_local(va_operand(va));
+    asm volatile("dsb nsh\nisb" ::: "memory");
+}
@@ -28,4 +28,7 @@
 #define BLOCK_ATTR_UXN (1ULL << 54)
 #define BLOCK_ATTR_PXN (1ULL << 53)
 
+// hint that the entry is one of an aligned run of 16 with contiguous output and identical attributes.
+#define TTE_CONTIGUOUS (1ULL << 52)
+
 #endif
@@ -1,25 +1,61 @@
+#include "config.h"
+#include "cpu.h"
 #include "interrupts.h"
 #include "memory.h"
 #include "macros.h"
 #include "./tt.h"
 #include "./pltfrm.h"
+#include "./init/mem_idx.h"
 
 #include "memory_map.h"
+#include "spinlock.h"
 #include "vmap.h"
 #include "prot.h"
+#include "kconsole.h"
 
 #if PAGE_SIZE != 4096
 #error Unimplemented
 #endif
 #define NUM_LEVELS 4
 
+// the shallowest level at which we'll place a block descriptor (1 GiB blocks).
+#define FIRST_BLOCK_LEVEL 1
+
+// number of level 3 entries covered by one contiguous hint (64 KiB).
+#define CONT_PAGES 16
+
+// returned when a range can't be mapped at the requested granularity.
+#define MAP_FALLBACK 1
+
+// software marker for an unmapped level 3 entry set aside by vmap_reserve. the entry stays
+// invalid, and the hardware ignores everything but bit 0 of an invalid entry.
+#define PTE_RESERVED (1ULL << 1)
+
+// software bit marking a leaf mapped with VMAP_FLAG_PRIVATE, so that unmapping it knows a local
+// invalidate is enough. bits [58:55] of a valid descriptor are ignored by the hardware.
+#define PTE_PRIVATE (1ULL << 55)
+
+// zeroed page-table pages each cpu keeps on hand.
+#define TABLE_RESERVE_MAX 32
+
 uint64_t *access_table(const uint64_t *indices, int level);
 void tlb_flush_addr(uint64_t addr);
 
-int gethwprot(uint64_t prot) {
+// serializes every walk, since unmapping may free tables out from under a concurrent walker.
+static volatile spinlock_t table_lock;
+
+// only ever touched by its own cpu, with irqs masked.
+struct table_reserve {
+    uint32_t count;
+    uintptr_t pages[TABLE_RESERVE_MAX];
+};
+
+static struct table_reserve table_reserves[MAX_CPUS];
+
+int64_t gethwprot(uint64_t prot) {
     prot &= 077;
     uint64_t prot_nx = prot & ~(uint64_t) (PROT_XUSR | PROT_XSYS);
-    int flag;
+    int64_t flag;
     if (prot_nx == (PROT_RUSR | PROT_RSYS)) {
         flag = AP_RDONLY_ALL;
     } else if (prot_nx == PROT_RSYS) {
@@ -108,98 +144,853 @@ uintptr_t first_addr_avail(uintptr_t start) {
 }
 */
 
+
+// the number of bytes mapped by one entry of a table at 'level'.
+static uint64_t level_size(int level) {
+    return (uint64_t)1 << (39 - 9 * level);
+}
+
+static uint64_t level_pages(int level) {
+    return level_size(level) / PAGE_SIZE;
+}
+
+static bool is_valid(uint64_t entry) {
+    return entry & 1;
+}
+
+// only meaningful for valid entries. level 3 entries are always pages.
+static bool is_table(uint64_t entry, int level) {
+    return level < NUM_LEVELS - 1 && (entry & 3) == TABLE_DESC;
+}
+
+static uint64_t entry_address(uint64_t entry, int level) {
+    int low = is_table(entry, level) ? LOG_PAGE_SIZE : 39 - 9 * level;
+    return entry & ONES_IN_RANGE(47, low);
+}
+
+// the attribute bits of a block or page descriptor, without its type and output address.
+static uint64_t entry_attributes(uint64_t entry) {
+    return entry & (ONES_IN_RANGE(63, 50) | ONES_IN_RANGE(11, 2));
+}
+
+static uint64_t memory_type_attributes(memory_type_t memory_type) {
+    uint64_t idx;
+
+    switch (memory_type) {
+        case MEMORY_TYPE_NON_CACHEABLE:
+            idx = MEM_NON_CACHEABLE_IDX;
+            break;
+        case MEMORY_TYPE_DEVICE_STRICT:
+            idx = MEM_DEV_STRICT_IDX;
+            break;
+        case MEMORY_TYPE_DEVICE_RELAXED:
+            idx = MEM_DEV_RELAXED_IDX;
+            break;
+        case MEMORY_TYPE_NORMAL:
+        default:
+            idx = MEM_NORMAL_IDX;
+            break;
+    }
+
+    return idx << TTE_MEM_ATTR_IDX_START;
+}
+
+// the page backing the table that 'entry' (a valid table descriptor at 'level') points to, or NULL
+// if the table isn't one of ours to count and free.
+static struct page *table_page(uint64_t entry, int level) {
+    struct page *page = phys_to_page(entry_address(entry, level));
+    return page && (page->flags & PAGE_FLAG_TABLE) ? page : NULL;
+}
+
+static void table_add_live(struct page *table, int64_t delta) {
+    if (table) {
+        table->table_live += delta;
+    }
+}
+
+static void mark_table(uintptr_t table_pa, uint32_t live) {
+    struct page *page = phys_to_page(table_pa);
+
+    if (page) {
+        page->flags |= PAGE_FLAG_TABLE;
+        page->table_live = live;
+    }
+}
+
+// makes table updates visible to the table walker before we go on to use them.
+static void table_barrier(void) {
+    asm volatile("dsb ishst\nisb" ::: "memory");
+}
+
+// this cpu's reserve, or NULL if we can't tell which cpu we're on yet.
+static struct table_reserve *local_reserve(void) {
+    cpu_t cpu = this_cpu();
+    return cpu < MAX_CPUS ? &table_reserves[cpu] : NULL;
+}
+
+/* hands out a zeroed page for a new table, from the reserve if possible. */
+static int acquire_table_page(uintptr_t *table_pa) {
+    int irqs = irqs_masked();
+    mask_irqs();
+
+    struct table_reserve *reserve = local_reserve();
+    bool found = reserve && reserve->count;
+
+    if (found) {
+        *table_pa = reserve->pages[--reserve->count];
+    }
+
+    restore_irq_mask(irqs);
+
+    if (found) {
+        return 0;
+    }
+
+    if (global_acquire_pages(1, table_pa, NULL) == -1) {
+        return -1;
+    }
+
+    clear_memory(phys_to_virt(*table_pa), PAGE_SIZE);
+    return 0;
+}
+
+/* takes back an empty (and therefore still zeroed) table page. */
+static void release_table_page(uintptr_t table_pa) {
+    int irqs = irqs_masked();
+    mask_irqs();
+
+    struct table_reserve *reserve = local_reserve();
+    bool kept = reserve && reserve->count < TABLE_RESERVE_MAX;
+
+    if (kept) {
+        reserve->pages[reserve->count++] = table_pa;
+    }
+
+    restore_irq_mask(irqs);
+
+    if (!kept) {
+        global_release_block(table_pa);
+    }
+}
+
+// the number of distinct entries at 'level' that [va, va + pages) touches.
+static size_t entries_spanned(uintptr_t va, size_t pages, int level) {
+    uint64_t size = level_size(level);
+    uintptr_t last = va + (pages - 1) * PAGE_SIZE;
+    return (last / size) - (va / size) + 1;
+}
+
+int vmap_prepare(uintptr_t va, size_t pages) {
+    if (!pages) {
+        return 0;
+    }
+
+    // the worst case: every table below the root is missing.
+    size_t needed = 0;
+    for (int level = 0; level < NUM_LEVELS - 1; level++) {
+        needed += entries_spanned(va, pages, level);
+    }
+
+    // topping up to the cap would look like success, and the rest would quietly be allocated
+    // under table_lock.
+    if (needed > TABLE_RESERVE_MAX) {
+        kprint("vmap_prepare: 0x%lx + %lu pages may need %lu tables, the reserve holds %u\n", va,
+               pages, needed, TABLE_RESERVE_MAX);
+        return VMAP_ERROR_PREPARE_TOO_BIG;
+    }
+
+    while (1) {
+        int irqs = irqs_masked();
+        mask_irqs();
+
+        struct table_reserve *reserve = local_reserve();
+        bool full = !reserve || reserve->count >= needed;
+
+        restore_irq_mask(irqs);
+
+        if (full) {
+            return 0;
+        }
+
+        // zero the page with irqs on, then hand it to whichever cpu we ended up on.
+        uintptr_t pa;
+        if (global_acquire_pages(1, &pa, NULL) == -1) {
+            return VMAP_ERROR_TABLE_NOMEM;
+        }
+
+        clear_memory(phys_to_virt(pa), PAGE_SIZE);
+        release_table_page(pa);
+    }
+}
+
 /* returns a table descriptor */
 static int create_new_table(uint64_t *descriptor) {
-    uint64_t begin;
-    if (global_acquire_pages(1, &begin, NULL) == -1) {
+    uintptr_t begin;
+    if (acquire_table_page(&begin) == -1) {
         return -1;
     }
 
-    clear_memory((void *)begin, PAGE_SIZE);
+    mark_table(begin, 0);
 
     *descriptor = begin | TABLE_DESC | TTE_AF;
 
     return 0;
 }
 
-int vmap(uintptr_t va, uintptr_t pa, uint64_t prot, memory_type_t memory_type, int flags) {
-    va &= ~(uintptr_t)(PAGE_SIZE - 1);
-    pa &= ~(uintptr_t)(PAGE_SIZE - 1);
+/* replaces the block descriptor *entry at 'level' (which maps block_va) with a table
+   describing the same mapping one level down. */
+static int split_block(uint64_t *entry, int level, uintptr_t block_va) {
+    uint64_t block = *entry;
+    uintptr_t table_pa;
 
-    int hwprot = gethwprot(prot);
+    if (acquire_table_page(&table_pa) == -1) {
+        return VMAP_ERROR_TABLE_NOMEM;
+    }
 
-    if (hwprot == -1) {
-        return VMAP_ERROR_INVALID_PROT;
+    uint64_t *table = phys_to_virt(table_pa);
+
+    int child = level + 1;
+    uint64_t pa = entry_address(block, level);
+    uint64_t attributes = entry_attributes(block) & ~TTE_CONTIGUOUS;
+    uint64_t type = child == NUM_LEVELS - 1 ? PAGE_DESC : BLOCK_DESC;
+
+    // the pages of a 2 MiB block are trivially contiguous.
+    if (child == NUM_LEVELS - 1) {
+        attributes |= TTE_CONTIGUOUS;
+    }
+
+    for (uint64_t i = 0; i < PAGE_SIZE / sizeof(uint64_t); i++) {
+        table[i] = (pa + i * level_size(child)) | attributes | type;
+    }
+
+    mark_table(table_pa, PAGE_SIZE / sizeof(uint64_t));
+
+    // break-before-make. anything touching the block in between takes a translation fault, so
+    // mask interrupts to keep the window as small as we can.
+    int irqs = irqs_masked();
+    mask_irqs();
+
+    *entry = 0;
+    tlb_flush_range(block_va, level_pages(level));
+    *entry = table_pa | TABLE_DESC | TTE_AF;
+    table_barrier();
+
+    restore_irq_mask(irqs);
+
+    return 0;
+}
+
+static uint64_t *cont_group(uint64_t *slot) {
+    return (uint64_t *)((uintptr_t)slot & ~(uintptr_t)(CONT_PAGES * sizeof(uint64_t) - 1));
+}
+
+/* clears the contiguous hint from the run containing the level 3 entry *slot (which maps va).
+   the architecture wants the whole run to be invalidated before any one entry of it changes. */
+static void break_contiguous(uint64_t *slot, uintptr_t va) {
+    uint64_t *group = cont_group(slot);
+    uint64_t saved[CONT_PAGES];
+
+    int irqs = irqs_masked();
+    mask_irqs();
+
+    for (int i = 0; i < CONT_PAGES; i++) {
+        saved[i] = group[i];
+        group[i] = 0;
+    }
+
+    tlb_flush_range(va & ~(uintptr_t)(CONT_PAGES * PAGE_SIZE - 1), CONT_PAGES);
+
+    for (int i = 0; i < CONT_PAGES; i++) {
+        group[i] = saved[i] & ~TTE_CONTIGUOUS;
     }
 
+    table_barrier();
+
+    restore_irq_mask(irqs);
+}
+
+/* walks down to the entry for va at 'level', creating tables along the way (and splitting blocks
+   in the way if we're allowed to remap). *table is set to the page of the table holding the entry,
+   see table_page. */
+static int walk_to_level(uintptr_t va, int level, int flags, uint64_t **slot,
+                         struct page **table) {
     uint64_t indices[NUM_LEVELS];
     kretrieve_indices(va, indices);
 
-    const int nlevels = NUM_LEVELS;
-    for (int level = 0; level < nlevels - 1; level++) {
-        uint64_t *ptr = access_table(indices, level);
-        uint64_t index = indices[level];
+    // the root table is never freed.
+    struct page *owner = NULL;
 
-        if (!(ptr[index] & 1)) {
+    for (int l = 0; l < level; l++) {
+        uint64_t *ptr = access_table(indices, l);
+        uint64_t *entry = ptr + indices[l];
+
+        if (!is_valid(*entry)) {
             uint64_t descriptor;
             if (create_new_table(&descriptor) == -1) {
                 return VMAP_ERROR_TABLE_NOMEM;
             }
 
-            ptr[index] |= descriptor;
+            *entry |= descriptor;
+            table_add_live(owner, 1);
+        } else if (!is_table(*entry, l)) {
+            // a block covers va.
+            if (!(flags & VMAP_FLAG_REMAP)) {
+                return VMAP_ERROR_ALREADY_MAPPED;
+            }
+
+            uintptr_t block_va = va & ~(uintptr_t)(level_size(l) - 1);
+            int r = split_block(entry, l, block_va);
+            if (r < 0) {
+                return r;
+            }
+        }
+
+        owner = table_page(*entry, l);
+    }
+
+    *slot = access_table(indices, level) + indices[level];
+    *table = owner;
+    return 0;
+}
+
+/* points *slot (the entry for va at 'level', in 'table') at pa. does not touch the tlb.
+   returns MAP_FALLBACK if a table already sits where a block would have to go. */
+static int set_entry(uint64_t *slot, struct page *table, int level, uintptr_t va, uintptr_t pa,
+                     uint64_t attributes, int flags) {
+    if (!*slot) {
+        table_add_live(table, 1);
+    } else if (is_valid(*slot)) {
+        if (is_table(*slot, level)) {
+            return MAP_FALLBACK;
+        }
+
+        if (!(flags & VMAP_FLAG_REMAP)) {
+            return VMAP_ERROR_ALREADY_MAPPED;
+        }
+
+        if (level < NUM_LEVELS - 1) {
+            // replacing a block needs break-before-make.
+            *slot = 0;
+            tlb_flush_range(va, level_pages(level));
+        } else if (*slot & TTE_CONTIGUOUS) {
+            break_contiguous(slot, va);
         }
     }
 
-    uint64_t *last = access_table(indices, nlevels - 1);
-    uint64_t lasti = indices[nlevels - 1];
+    uint64_t type = level == NUM_LEVELS - 1 ? PAGE_DESC : BLOCK_DESC;
+    *slot = pa | type | TTE_AF | attributes;
+
+    return 0;
+}
+
+/* maps va to pa with a descriptor at 'level' (a page at level 3, a block otherwise).
+   does not touch the tlb. */
+static int map_at_level(uintptr_t va, uintptr_t pa, int level, uint64_t attributes, int flags) {
+    uint64_t *slot;
+    struct page *table;
+    int r = walk_to_level(va, level, flags, &slot, &table);
+    if (r < 0) {
+        return r;
+    }
+
+    return set_entry(slot, table, level, va, pa, attributes, flags);
+}
+
+// the number of level 3 entries from va's up to the end of its table.
+static size_t table_entries_left(uintptr_t va) {
+    return PAGE_SIZE / sizeof(uint64_t) - EXTRACT(va, 20, 12);
+}
+
+static int get_attributes(uint64_t prot, memory_type_t memory_type, int flags,
+                          uint64_t *attributes) {
+    int64_t hwprot = gethwprot(prot);
+
+    if (hwprot == -1) {
+        return VMAP_ERROR_INVALID_PROT;
+    }
+
+    *attributes = hwprot | memory_type_attributes(memory_type);
+
+    if (flags & VMAP_FLAG_PRIVATE) {
+        *attributes |= PTE_PRIVATE;
+    }
+
+    return 0;
+}
+
+static int do_vmap(uintptr_t va, uintptr_t pa, uint64_t prot, memory_type_t memory_type,
+                   int flags) {
+    va &= ~(uintptr_t)(PAGE_SIZE - 1);
+    pa &= ~(uintptr_t)(PAGE_SIZE - 1);
 
-    uint64_t *slot = last + lasti;
+    uint64_t attributes;
+    int r = get_attributes(prot, memory_type, flags, &attributes);
+    if (r < 0) {
+        return r;
+    }
 
-    if (*slot & 1 && !(flags & VMAP_FLAG_REMAP)) {
-        return VMAP_ERROR_ALREADY_MAPPED;
+    r = map_at_level(va, pa, NUM_LEVELS - 1, attributes, flags);
+    if (r < 0) {
+        return r;
     }
 
-    *slot = pa | PAGE_DESC | TTE_AF | hwprot;
+    if (flags & VMAP_FLAG_NO_FLUSH) {
+        // nothing to invalidate, but the new entry still has to reach the walker before it's used.
+        table_barrier();
+        return 0;
+    }
 
-    tlb_flush_addr(va);
+    if (flags & VMAP_FLAG_PRIVATE) {
+        tlb_flush_addr_local(va);
+    } else {
+        tlb_flush_addr(va);
+    }
 
     return 0;
 }
 
-int vumap(uintptr_t va) {
+// the deepest level at which one descriptor can map all of [va, va + pages) to pa.
+static int best_level(uintptr_t va, uintptr_t pa, size_t pages) {
+    for (int level = FIRST_BLOCK_LEVEL; level < NUM_LEVELS - 1; level++) {
+        uint64_t mask = level_size(level) - 1;
+
+        if (!(va & mask) && !(pa & mask) && pages >= level_pages(level)) {
+            return level;
+        }
+    }
+
+    return NUM_LEVELS - 1;
+}
+
+static bool is_cont_aligned(uintptr_t va, uintptr_t pa, size_t pages) {
+    uint64_t mask = CONT_PAGES * PAGE_SIZE - 1;
+    return !(va & mask) && !(pa & mask) && pages >= CONT_PAGES;
+}
+
+static bool run_is_free(const uint64_t *slot) {
+    for (int i = 0; i < CONT_PAGES; i++) {
+        if (slot[i]) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* maps as much of [va, va + pages) as falls in the level 3 table covering va, walking down to
+   that table only once. the number of pages mapped goes in *mapped. does not touch the tlb. */
+static int fill_table(uintptr_t va, uintptr_t pa, size_t pages, uint64_t attributes, int flags,
+                      size_t *mapped) {
+    *mapped = 0;
+
+    uint64_t *slot;
+    struct page *table;
+    int r = walk_to_level(va, NUM_LEVELS - 1, flags, &slot, &table);
+    if (r < 0) {
+        return r;
+    }
+
+    size_t count = KMIN(pages, table_entries_left(va));
+    size_t i = 0;
+
+    while (i < count) {
+        uintptr_t page_va = va + i * PAGE_SIZE;
+        uintptr_t page_pa = pa + i * PAGE_SIZE;
+
+        // table boundaries are 64 KiB aligned, so an aligned run never straddles one.
+        if (is_cont_aligned(page_va, page_pa, count - i) && run_is_free(slot + i)) {
+            for (int j = 0; j < CONT_PAGES; j++) {
+                slot[i + j] = (page_pa + j * PAGE_SIZE) | PAGE_DESC | TTE_AF | TTE_CONTIGUOUS |
+                              attributes;
+            }
+
+            table_add_live(table, CONT_PAGES);
+
+            i += CONT_PAGES;
+            continue;
+        }
+
+        r = set_entry(slot + i, table, NUM_LEVELS - 1, page_va, page_pa, attributes, flags);
+        if (r < 0) {
+            break;
+        }
+
+        i++;
+    }
+
+    *mapped = i;
+    return r;
+}
+
+static int do_vmap_range(uintptr_t start_va, uintptr_t start_pa, size_t pages, uint64_t prot,
+                         memory_type_t memory_type, int flags) {
+    start_va &= ~(uintptr_t)(PAGE_SIZE - 1);
+    start_pa &= ~(uintptr_t)(PAGE_SIZE - 1);
+
+    uint64_t attributes;
+    int r = get_attributes(prot, memory_type, flags, &attributes);
+    if (r < 0) {
+        return r;
+    }
+
+    size_t done = 0;
+
+    while (done < pages) {
+        uintptr_t va = start_va + done * PAGE_SIZE;
+        uintptr_t pa = start_pa + done * PAGE_SIZE;
+        int level = best_level(va, pa, pages - done);
+
+        if (level < NUM_LEVELS - 1) {
+            r = map_at_level(va, pa, level, attributes, flags);
+            if (r < 0) {
+                break;
+            }
+
+            if (r != MAP_FALLBACK) {
+                done += level_pages(level);
+                continue;
+            }
+
+            // something is already mapped at a finer granularity, fill in its table instead.
+        }
+
+        size_t mapped;
+        r = fill_table(va, pa, pages - done, attributes, flags, &mapped);
+        done += mapped;
+
+        if (r < 0) {
+            break;
+        }
+    }
+
+    if ((flags & VMAP_FLAG_NO_FLUSH) && done) {
+        table_barrier();
+    } else if (done) {
+        if (flags & VMAP_FLAG_PRIVATE) {
+            tlb_flush_range_local(start_va, done);
+        } else {
+            tlb_flush_range(start_va, done);
+        }
+    }
+
+    return r < 0 ? r : 0;
+}
+
+int vmap(uintptr_t va, uintptr_t pa, uint64_t prot, memory_type_t memory_type, int flags) {
+    spin_lock_irq(&table_lock);
+    int r = do_vmap(va, pa, prot, memory_type, flags);
+    spin_unlock_irq(&table_lock);
+
+    return r;
+}
+
+int vmap_range(uintptr_t start_va, uintptr_t start_pa, size_t pages, uint64_t prot,
+               memory_type_t memory_type, int flags) {
+    spin_lock_irq(&table_lock);
+    int r = do_vmap_range(start_va, start_pa, pages, prot, memory_type, flags);
+    spin_unlock_irq(&table_lock);
+
+    return r;
+}
+
+static int do_vmap_reserve(uintptr_t start_va, size_t pages) {
+    size_t done = 0;
+
+    while (done < pages) {
+        uintptr_t va = start_va + done * PAGE_SIZE;
+
+        uint64_t *slot;
+        struct page *table;
+        int r = walk_to_level(va, NUM_LEVELS - 1, 0, &slot, &table);
+        if (r < 0) {
+            return r;
+        }
+
+        size_t count = KMIN(pages - done, table_entries_left(va));
+
+        for (size_t i = 0; i < count; i++) {
+            if (!slot[i]) {
+                slot[i] = PTE_RESERVED;
+                table_add_live(table, 1);
+            }
+        }
+
+        done += count;
+    }
+
+    return 0;
+}
+
+int vmap_reserve(uintptr_t start_va, size_t pages) {
+    start_va &= ~(uintptr_t)(PAGE_SIZE - 1);
+
+    spin_lock_irq(&table_lock);
+    int r = do_vmap_reserve(start_va, pages);
+    spin_unlock_irq(&table_lock);
+
+    return r;
+}
+
+int vmap_fault_in(uintptr_t va, uintptr_t pa, uint64_t prot, memory_type_t memory_type) {
+    va &= ~(uintptr_t)(PAGE_SIZE - 1);
+    pa &= ~(uintptr_t)(PAGE_SIZE - 1);
+
+    uint64_t attributes;
+    int r = get_attributes(prot, memory_type, 0, &attributes);
+    if (r < 0) {
+        return r;
+    }
+
     uint64_t indices[NUM_LEVELS];
     kretrieve_indices(va, indices);
 
-    // Validate the translation so we don't have to deal with an MMU fault.
+    // no table_lock: we may have interrupted its holder. a reserved entry keeps its table alive, so
+    // if we find one, nobody can free the tables above it in the meantime.
+    for (int level = 0; level < NUM_LEVELS - 1; level++) {
+        uint64_t entry = access_table(indices, level)[indices[level]];
 
-    const int nlevels = NUM_LEVELS;
+        if (!is_valid(entry) || !is_table(entry, level)) {
+            return VMAP_ERROR_NOT_RESERVED;
+        }
+    }
 
-    uint64_t *ptr;
+    uint64_t *slot = access_table(indices, NUM_LEVELS - 1) + indices[NUM_LEVELS - 1];
+    uint64_t expected = PTE_RESERVED;
 
-    for (int level = 0; level < nlevels; level++) {
-        ptr = access_table(indices, level);
+    if (!__atomic_compare_exchange_n(slot, &expected, pa | PAGE_DESC | TTE_AF | attributes, false,
+                                     __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        return VMAP_ERROR_NOT_RESERVED;
+    }
 
-        uint64_t index = indices[level];
+    // an invalid entry is never cached, so there's nothing to invalidate.
+    table_barrier();
 
-        if (!(ptr[index] & 1)) {
+    return 0;
+}
+
+// whether the tlb entries for a leaf we're clearing may be on other cpus.
+static bool shared_leaf(uint64_t entry) {
+    return is_valid(entry) && !(entry & PTE_PRIVATE);
+}
+
+/* clears as much of [va, va + pages) as falls in the level 3 table holding *slot (va's entry).
+   stops early at the first page that is neither mapped nor reserved. returns the number of pages
+   cleared, and sets *shared if any of them was mapped without VMAP_FLAG_PRIVATE. */
+static size_t clear_table(uint64_t *slot, uintptr_t va, size_t pages, bool *shared) {
+    size_t count = KMIN(pages, table_entries_left(va));
+    size_t i = 0;
+
+    while (i < count && slot[i]) {
+        *shared |= shared_leaf(slot[i]);
+
+        if (slot[i] & TTE_CONTIGUOUS) {
+            if (cont_group(slot + i) == slot + i && count - i >= CONT_PAGES) {
+                // the whole run goes away.
+                for (int j = 0; j < CONT_PAGES; j++) {
+                    slot[i + j] = 0;
+                }
+
+                i += CONT_PAGES;
+                continue;
+            }
+
+            break_contiguous(slot + i, va + i * PAGE_SIZE);
+        }
+
+        slot[i++] = 0;
+    }
+
+    return i;
+}
+
+/* frees the tables on va's walk, from 'level' upward, that no longer hold any valid entries.
+   entries[l] is va's entry in the table at level l, and tables[l] that table's page. */
+static void reclaim_tables(uintptr_t va, const uint64_t *indices, uint64_t *const *entries,
+                           struct page *const *tables, int level) {
+    for (int l = level; l > 0; l--) {
+        struct page *table = tables[l];
+
+        if (!table || table->table_live) {
+            return;
+        }
+
+        uintptr_t table_va = (uintptr_t)access_table(indices, l);
+
+        *entries[l - 1] = 0;
+        table_add_live(tables[l - 1], -1);
+
+        // the walk caches may still hold the descriptor we just cleared, so go by va without a
+        // level hint. the tlb may also hold the recursive mapping of the table itself, which is
+        // always a level 3 leaf.
+        tlb_flush_addr_level(va, 0);
+        tlb_flush_addr_level(table_va, NUM_LEVELS - 1);
+
+        table->flags &= ~PAGE_FLAG_TABLE;
+        release_table_page(table->addr);
+    }
+}
+
+/* clears the mapping of [va, va + pages) up to the end of the first block or table it falls in,
+   and frees any tables left empty. blocks and contiguous runs that are only partially covered are
+   split first.
+   returns the number of pages unmapped, or a negative error. does not touch the tlb for the
+   unmapped pages themselves, but sets *shared if another cpu may have them cached. */
+static int64_t unmap_walk(uintptr_t va, size_t pages, bool *shared) {
+    uint64_t indices[NUM_LEVELS];
+    uint64_t *entries[NUM_LEVELS];
+    struct page *tables[NUM_LEVELS];
+    kretrieve_indices(va, indices);
+
+    // the root table is never freed.
+    tables[0] = NULL;
+
+    for (int level = 0; level < NUM_LEVELS; level++) {
+        uint64_t *entry = access_table(indices, level) + indices[level];
+        entries[level] = entry;
+
+        // Validate the translation so we don't have to deal with an MMU fault. reserved level 3
+        // entries get cleared like mapped ones.
+        if (!*entry) {
             return VUMAP_ERROR_NOT_MAPPED;
         }
+
+        if (is_table(*entry, level)) {
+            tables[level + 1] = table_page(*entry, level);
+            continue;
+        }
+
+        int64_t cleared;
+
+        if (level == NUM_LEVELS - 1) {
+            cleared = clear_table(entry, va, pages, shared);
+            table_add_live(tables[level], -cleared);
+        } else {
+            uintptr_t block_va = va & ~(uintptr_t)(level_size(level) - 1);
+
+            if (block_va != va || pages < level_pages(level)) {
+                // only part of the block goes away.
+                int r = split_block(entry, level, block_va);
+                if (r < 0) {
+                    return r;
+                }
+
+                tables[level + 1] = table_page(*entry, level);
+                continue;
+            }
+
+            *shared |= shared_leaf(*entry);
+            *entry = 0;
+            table_add_live(tables[level], -1);
+            cleared = level_pages(level);
+        }
+
+        reclaim_tables(va, indices, entries, tables, level);
+        return cleared;
     }
 
-    uint64_t index = indices[nlevels - 1];
-    ptr[index] = 0;
+    // unreachable: level 3 entries are never tables.
+    return VUMAP_ERROR_NOT_MAPPED;
+}
+
+static int do_vumap(uintptr_t va, bool flush) {
+    va &= ~(uintptr_t)(PAGE_SIZE - 1);
 
-    tlb_flush_addr(va);
+    bool shared = false;
 
-    // TODO: Map unmap higher levels if we were the only guy left?
+    spin_lock_irq(&table_lock);
+    int64_t r = unmap_walk(va, 1, &shared);
+    spin_unlock_irq(&table_lock);
+
+    if (r < 0) {
+        return r;
+    }
+
+    // blocks are split before a single page is unmapped, so the leaf was a level 3 entry.
+    if (flush && shared) {
+        tlb_flush_addr_level(va, NUM_LEVELS - 1);
+    } else if (flush) {
+        tlb_flush_addr_local(va);
+    }
 
     return 0;
 }
 
+int vumap(uintptr_t va) {
+    return do_vumap(va, true);
+}
+
+int vumap_noflush(uintptr_t va) {
+    return do_vumap(va, false);
+}
+
+static int do_vumap_range(uintptr_t start_va, size_t pages, bool flush) {
+    start_va &= ~(uintptr_t)(PAGE_SIZE - 1);
+
+    size_t done = 0;
+    int error = 0;
+    bool shared = false;
+
+    spin_lock_irq(&table_lock);
+
+    while (done < pages) {
+        int64_t r = unmap_walk(start_va + done * PAGE_SIZE, pages - done, &shared);
+
+        if (r == VUMAP_ERROR_NOT_MAPPED) {
+            // a hole, e.g. a guard page. unmap the rest anyway, but let the caller know.
+            error = r;
+            done++;
+            continue;
+        }
+
+        if (r < 0) {
+            error = r;
+            break;
+        }
+
+        done += r;
+    }
+
+    spin_unlock_irq(&table_lock);
+
+    if (flush && done && shared) {
+        tlb_flush_range(start_va, done);
+    } else if (flush && done) {
+        tlb_flush_range_local(start_va, done);
+    }
+
+    return error;
+}
+
+int vumap_range(uintptr_t start_va, size_t pages) {
+    return do_vumap_range(start_va, pages, true);
+}
+
+int vumap_range_noflush(uintptr_t start_va, size_t pages) {
+    return do_vumap_range(start_va, pages, false);
+}
+
 uintptr_t get_phys_mapping(uintptr_t va) {
-    uint64_t indices[4];
+    uint64_t indices[NUM_LEVELS];
     kretrieve_indices(va, indices);
 
-    uint64_t *table_vals = access_table(indices, 3);
-    return (table_vals[indices[3]] & ONES_IN_RANGE(47, LOG_PAGE_SIZE)) + (va & (PAGE_SIZE - 1));
+    uintptr_t pa = 0;
+
+    spin_lock_irq(&table_lock);
+
+    for (int level = 0; level < NUM_LEVELS; level++) {
+        uint64_t entry = access_table(indices, level)[indices[level]];
+
+        if (!is_valid(entry)) {
+            break;
+        }
+
+        if (!is_table(entry, level)) {
+            pa = entry_address(entry, level) + (va & (level_size(level) - 1));
+            break;
+        }
+    }
+
+    spin_unlock_irq(&table_lock);
+
+    return pa;
 }
@@ -10,6 +10,32 @@
 // 64 KiB
 #define KSTACK_SIZE (2 * PAGE_SIZE)
 
-#define HZ 10
+// the period (in microseconds) over which every queued task should get to run once, split by
+// weight. past SCHED_LATENCY_US / SCHED_MIN_GRANULARITY_US tasks it stretches instead, so that no
+// slice is shorter than SCHED_MIN_GRANULARITY_US.
+#define SCHED_LATENCY_US 20000
+#define SCHED_MIN_GRANULARITY_US 4000
+
+// a waking task preempts the running one only once it's this far (in microseconds, for a nice 0
+// task) behind it in vruntime, so that wakeups don't thrash the cpu back and forth.
+#define SCHED_WAKEUP_GRANULARITY_US 1000
+
+// round robin rt tasks of the same priority take turns in slices this long (in microseconds).
+#define SCHED_RR_TIMESLICE_US 100000
+
+// rt tasks get at most SCHED_RT_RUNTIME_US of every SCHED_RT_PERIOD_US on a cpu while normal tasks
+// are waiting there, so they can't starve them entirely.
+#define SCHED_RT_PERIOD_US 1000000
+#define SCHED_RT_RUNTIME_US 950000
+
+// deadline tasks are only admitted to a cpu while their summed runtime / period stays under this.
+#define SCHED_DL_UTIL_MAX_PERCENT 95
+
+// how often (in timer ticks) each cpu looks for a busier one to pull tasks from.
+#define SCHED_BALANCE_TICKS 4
+
+// bit n set -> cpu n is nohz_full: it stops its tick while it has just one task to run, and
+// gets no tasks it isn't pinned to if another cpu can take them.
+#define NOHZ_FULL_CPUS 0x0ULL
 
 #endif
@@ -29,3 +29,12 @@ void cpu_affinity_clear(cpu_affinity_t *aff, cpu_t cpu) {
 
     *(*aff + index) &= ~(1ull << offset);
 }
+
+bool cpu_affinity_test(const cpu_affinity_t *aff, cpu_t cpu) {
+    if (cpu >= MAX_CPUS) return false;
+
+    size_t index = cpu / 64;
+    size_t offset = cpu % 64;
+
+    return (*(*aff + index) >> offset) & 1;
+}
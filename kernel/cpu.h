@@ -19,5 +19,6 @@ void cpu_affinity_clear_all(cpu_affinity_t *aff);
 void cpu_affinity_set_all(cpu_affinity_t *aff);
 void cpu_affinity_set(cpu_affinity_t *aff, cpu_t cpu);
 void cpu_affinity_clear(cpu_affinity_t *aff, cpu_t cpu);
+bool cpu_affinity_test(const cpu_affinity_t *aff, cpu_t cpu);
 
 #endif
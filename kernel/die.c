@@ -1,5 +1,7 @@
 #include "die.h"
 #include "kconsole.h"
+#include "kstack.h"
+#include "sched.h"
 
 void kprint_nolock(const char *f, ...);
 void kprintv_nolock(const char *s, va_list l);
@@ -13,5 +15,9 @@ void kprintv_nolock(const char *s, va_list l);
     klockout(0);
     va_end(list);
 
+    // there's no clean shutdown, so this is where a run ends: dump what we've counted so far.
+    kstack_report();
+    sched_report();
+
     die();
 }
@@ -1,11 +1,8 @@
 #include "gpa.h"
 #include "die.h"
-#include "kvmalloc.h"
 #include "memory.h"
 #include "memory_map.h"
 #include "pltfrm.h"
-#include "prot.h"
-#include "vmap.h"
 
 static size_t get_block_size(block_header_t *b) {
     return b->free_block.metadata & ~0xfUL;
@@ -288,10 +285,7 @@ heap_region_header_t *def_gpa_acquire(void *user, size_t alloc_size) {
 
     alloc_size = end - begin;
 
-    size_t pages = alloc_size / PAGE_SIZE;
-
-    heap_region_header_t *hdr = kvmalloc(pages, 0);
-    vmap_range((uintptr_t)hdr, begin, pages, PROT_RSYS | PROT_WSYS, MEMORY_TYPE_NORMAL, 0);
+    heap_region_header_t *hdr = phys_to_virt(begin);
 
     hdr->size = alloc_size;
 
@@ -299,10 +293,5 @@ heap_region_header_t *def_gpa_acquire(void *user, size_t alloc_size) {
 }
 
 void def_gpa_release(void *user, heap_region_header_t *region) {
-    size_t pages = region->size / PAGE_SIZE;
-
-    global_release_block(get_phys_mapping((uintptr_t)region));
-    vumap_range((uintptr_t)region, pages);
-
-    kvfree(region);
+    global_release_block(virt_to_phys(region));
 }
@@ -90,6 +90,8 @@ void create_memory_map(void) {
 
         while (page_index < cur->pages) {
             current_page_item->allocated = 0;
+            current_page_item->flags = 0;
+            current_page_item->table_live = 0;
             current_page_item->addr = addr;
             current_page_item->heap_index = heap_index;
             current_page_item->page_index = page_index;
@@ -3,7 +3,8 @@
 
 #include "types.h"
 
-// Don't perform a tlb shootdown for the virtual address(es).
+// Don't perform a tlb shootdown for the virtual address(es). kmalloc memory comes from the direct
+// map, which is never remapped, so there is none to skip and this is currently a no-op.
 #define KMALLOC2_PRIVATE 0x1
 
 void *kmalloc2(size_t size, int flags);
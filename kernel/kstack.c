@@ -0,0 +1,275 @@
+#include "kstack.h"
+#include "cpu.h"
+#include "die.h"
+#include "kconsole.h"
+#include "kvmalloc.h"
+#include "memory_map.h"
+#include "pltfrm.h"
+#include "prot.h"
+#include "sched.h"
+#include "vmap.h"
+
+// stacks each cpu keeps mapped and ready.
+#define KSTACK_CACHE_MAX 8
+
+// pages mapped when a stack is handed out. the rest are mapped on first touch.
+#define KSTACK_INITIAL_PAGES 1
+
+// physical pages each cpu keeps for growing stacks, so the fault path never has to go to the
+// buddy allocator (whose lock the faulting code may well be holding).
+#define KSTACK_GROW_RESERVE 4
+
+// only ever touched by its own cpu, with irqs masked.
+struct kstack_cache {
+    uint32_t count;
+    uintptr_t stacks[KSTACK_CACHE_MAX];
+
+    uint32_t grow_count;
+    uintptr_t grow_pages[KSTACK_GROW_RESERVE];
+};
+
+static struct kstack_cache kstack_caches[MAX_CPUS];
+
+// peak_histogram[n] counts the freed stacks that had n pages mapped at their peak.
+static uint64_t peak_histogram[KSTACK_PAGES + 1];
+
+static struct kstack_cache *local_cache(void) {
+    cpu_t cpu = this_cpu();
+    return cpu < MAX_CPUS ? &kstack_caches[cpu] : NULL;
+}
+
+static uintptr_t cache_pop(void) {
+    uintptr_t base = 0;
+
+    int irqs = irqs_masked();
+    mask_irqs();
+
+    struct kstack_cache *cache = local_cache();
+    if (cache && cache->count) {
+        base = cache->stacks[--cache->count];
+    }
+
+    restore_irq_mask(irqs);
+
+    return base;
+}
+
+static bool cache_push(uintptr_t base) {
+    bool kept = false;
+
+    int irqs = irqs_masked();
+    mask_irqs();
+
+    struct kstack_cache *cache = local_cache();
+    if (cache && cache->count < KSTACK_CACHE_MAX) {
+        cache->stacks[cache->count++] = base;
+        kept = true;
+    }
+
+    restore_irq_mask(irqs);
+
+    return kept;
+}
+
+// tops up this cpu's grow reserve. must not be called from the fault path.
+static void refill_grow_reserve(void) {
+    while (1) {
+        int irqs = irqs_masked();
+        mask_irqs();
+
+        struct kstack_cache *cache = local_cache();
+        bool full = !cache || cache->grow_count == KSTACK_GROW_RESERVE;
+
+        restore_irq_mask(irqs);
+
+        if (full) {
+            return;
+        }
+
+        uintptr_t pa;
+        if (global_acquire_pages(1, &pa, NULL) == -1) {
+            return;
+        }
+
+        irqs = irqs_masked();
+        mask_irqs();
+
+        cache = local_cache();
+        bool kept = cache && cache->grow_count < KSTACK_GROW_RESERVE;
+        if (kept) {
+            cache->grow_pages[cache->grow_count++] = pa;
+        }
+
+        restore_irq_mask(irqs);
+
+        if (!kept) {
+            global_release_block(pa);
+        }
+    }
+}
+
+// the address of page 'page' of a stack, counted up from the base.
+static uintptr_t stack_page(uintptr_t base, size_t page) {
+    return base + page * PAGE_SIZE;
+}
+
+static void map_stack_page(uintptr_t va) {
+    uintptr_t pa;
+    if (global_acquire_pages(1, &pa, NULL) == -1) {
+        KFATAL("Failed to allocate kernel stack.\n");
+    }
+
+    int r = vmap(va, pa, PROT_RSYS | PROT_WSYS, MEMORY_TYPE_NORMAL, VMAP_FLAG_NO_FLUSH);
+    if (r < 0) {
+        KFATAL("Failed to map kernel stack: %d\n", r);
+    }
+}
+
+uintptr_t kstack_alloc(void) {
+    refill_grow_reserve();
+
+    uintptr_t base = cache_pop();
+    if (base) {
+        return base;
+    }
+
+    // one extra page for the guard, which is neither mapped nor reserved.
+    void *ptr = kvmalloc(KSTACK_PAGES + 1, 0);
+    if (!ptr) {
+        KFATAL("Failed to reserve kernel stack space.\n");
+    }
+
+    base = (uintptr_t)ptr + PAGE_SIZE;
+
+    // the tables come out of this cpu's reserve, so stay on it until they're in.
+    sched_preempt_disable();
+
+    int r = vmap_prepare(base, KSTACK_PAGES);
+    if (r >= 0) {
+        r = vmap_reserve(base, KSTACK_PAGES);
+    }
+
+    sched_preempt_enable();
+
+    if (r < 0) {
+        KFATAL("Failed to reserve kernel stack: %d\n", r);
+    }
+
+    // no flush needed: ranges only go back to kvmalloc once they've been flushed (by kvfree_lazy
+    // or before kvfree), so no tlb holds anything for it. vmap still orders the new entries before
+    // our first use of them.
+    kstack_populate(base, KSTACK_INITIAL_PAGES);
+
+    return base;
+}
+
+void kstack_populate(uintptr_t base, size_t pages) {
+    for (size_t i = KSTACK_PAGES - pages; i < KSTACK_PAGES; i++) {
+        uintptr_t va = stack_page(base, i);
+
+        if (!get_phys_mapping(va)) {
+            map_stack_page(va);
+        }
+    }
+}
+
+size_t kstack_used_pages(uintptr_t base) {
+    size_t pages = 0;
+
+    while (pages < KSTACK_PAGES && get_phys_mapping(stack_page(base, KSTACK_PAGES - 1 - pages))) {
+        pages++;
+    }
+
+    return pages;
+}
+
+// unmaps the pages of the stack below its top 'keep' pages, and frees them once no tlb holds them.
+static void release_pages(uintptr_t base, size_t keep) {
+    size_t pages = KSTACK_PAGES - keep;
+    uintptr_t pas[KSTACK_PAGES];
+
+    for (size_t i = 0; i < pages; i++) {
+        pas[i] = get_phys_mapping(stack_page(base, i));
+    }
+
+    // no page goes back to the buddy allocator while a tlb could still map it.
+    vumap_range(base, pages);
+
+    for (size_t i = 0; i < pages; i++) {
+        if (pas[i]) {
+            global_release_block(pas[i]);
+        }
+    }
+}
+
+void kstack_free(uintptr_t base) {
+    refill_grow_reserve();
+
+    size_t used = kstack_used_pages(base);
+    __atomic_fetch_add(&peak_histogram[used], 1, __ATOMIC_RELAXED);
+
+    if (used > KSTACK_INITIAL_PAGES) {
+        // hand out the cached stack as small as a fresh one, so the next task's usage is its own.
+        release_pages(base, KSTACK_INITIAL_PAGES);
+        vmap_reserve(base, KSTACK_PAGES - KSTACK_INITIAL_PAGES);
+    }
+
+    if (cache_push(base)) {
+        return;
+    }
+
+    // clears the reserved entries too, and flushes: the pages can't be freed before that, so the
+    // range can't wait for a lazy purge either.
+    release_pages(base, 0);
+
+    // the guard page was never mapped, so nothing of the range is left in any tlb.
+    kvfree((void *)(base - PAGE_SIZE));
+}
+
+bool kstack_grow(uintptr_t addr) {
+    /* the stack isn't necessarily current_task's: irqs and the tail of a context switch run on
+       whatever stack was live, and the idle loop runs with no task at all. so rather than ask
+       which stack we're on, go by the page itself. only kernel stacks reserve pages, and
+       vmap_fault_in only maps reserved ones, so a page it takes is some stack's page. */
+    struct kstack_cache *cache = local_cache();
+    uintptr_t fault_page = addr & ~(uintptr_t)(PAGE_SIZE - 1);
+
+    // map everything from the faulting page up to what's already there, a big frame may have
+    // skipped some pages. no stack has more than KSTACK_PAGES of them.
+    for (size_t i = 0; i < KSTACK_PAGES; i++) {
+        uintptr_t va = fault_page + i * PAGE_SIZE;
+
+        if (!cache || !cache->grow_count) {
+            if (va == fault_page) {
+                kprint("Out of reserved pages for growing the kernel stack\n");
+                return false;
+            }
+
+            // the faulting page is in. if the ones above it aren't, we'll be back.
+            return true;
+        }
+
+        uintptr_t pa = cache->grow_pages[cache->grow_count - 1];
+
+        if (vmap_fault_in(va, pa, PROT_RSYS | PROT_WSYS, MEMORY_TYPE_NORMAL) < 0) {
+            // everything from here up is mapped already (the stack's top, or the guard of the
+            // range above). if that goes for the faulting page itself, it was never a stack page
+            // to grow (a guard page hit by an overflow, say), and retrying would just fault again.
+            return va != fault_page;
+        }
+
+        cache->grow_count--;
+    }
+
+    return true;
+}
+
+void kstack_report(void) {
+    kprint("Peak kernel stack usage of freed tasks (pages: tasks):");
+
+    for (size_t i = 0; i <= KSTACK_PAGES; i++) {
+        kprint(" %lu: %lu", i, __atomic_load_n(&peak_histogram[i], __ATOMIC_RELAXED));
+    }
+
+    kprint("\n");
+}
@@ -0,0 +1,33 @@
+#ifndef KERNEL_KSTACK_H_
+#define KERNEL_KSTACK_H_
+
+#include "types.h"
+#include "config.h"
+
+#define KSTACK_PAGES ((KSTACK_SIZE + PAGE_SIZE - 1) / PAGE_SIZE)
+
+/* returns the base (lowest address) of a KSTACK_SIZE kernel stack.
+   only the top page is mapped up front, the rest is reserved and gets mapped by kstack_grow the
+   first time it's touched. the page right below the base is never mapped, so running off the end
+   of the stack faults instead of scribbling over whatever lives next to it. */
+uintptr_t kstack_alloc(void);
+
+/* gives back a stack from kstack_alloc. the stack is kept mapped in a per-cpu cache while
+   there's room, so that the next kstack_alloc on this cpu is cheap. */
+void kstack_free(uintptr_t base);
+
+// makes sure the top 'pages' pages of the stack at base are mapped.
+void kstack_populate(uintptr_t base, size_t pages);
+
+// the number of pages of the stack at base that are mapped, i.e. its peak usage so far.
+size_t kstack_used_pages(uintptr_t base);
+
+/* called from the fault handler with the faulting address. if addr is in a page of some kernel
+   stack that was reserved but not mapped yet (the stack in use isn't always current_task's), maps
+   it and any missing pages above it and returns true, false otherwise. */
+bool kstack_grow(uintptr_t addr);
+
+// prints how many pages freed tasks' stacks peaked at.
+void kstack_report(void);
+
+#endif
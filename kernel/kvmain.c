@@ -15,32 +15,23 @@ uint64_t kernel_start, kernel_end, kernel_brk;
 
 struct fdt_header *fdt_header_phys;
 
-uintptr_t map_percpu(uintptr_t va_start) {
+// a fresh copy of the percpu section, in the direct map.
+void *percpu_copy(void) {
     extern char __percpu_begin, __percpu_end;
     uintptr_t percpu_begin = (uintptr_t)&__percpu_begin;
     uintptr_t percpu_end = (uintptr_t)&__percpu_end;
 
-    uintptr_t offset = 0;
+    size_t pages = (percpu_end - percpu_begin + PAGE_SIZE - 1) / PAGE_SIZE;
 
-    while (percpu_begin + offset < percpu_end) {
-        int r;
-        uintptr_t reg;
-        r = global_acquire_pages(1, &reg, NULL);
-        if (r == -1) {
-            KFATAL("Failed to acquire necessary memory\n");
-        }
-
-        r = vmap(va_start + offset, reg, PROT_RSYS | PROT_WSYS, MEMORY_TYPE_NORMAL, 0);
-        if (r < 0) {
-            KFATAL("vmap error: %d\n", r);
-        }
-
-        offset += PAGE_SIZE;
+    uintptr_t pa;
+    if (global_acquire_pages(pages, &pa, NULL) == -1) {
+        KFATAL("Failed to acquire necessary memory\n");
     }
 
-    copy_memory((void *)va_start, (void *)percpu_begin, percpu_end - percpu_begin);
+    void *copy = phys_to_virt(pa);
+    copy_memory(copy, (void *)percpu_begin, percpu_end - percpu_begin);
 
-    return va_start + offset;
+    return copy;
 }
 
 // Kernel virtual entry point (higher half)
@@ -51,11 +42,9 @@ void kvmain(uintptr_t vbrk) {
     set_percpu_start(0);
 
     reserve_active_kernel_memory();
+    direct_map_init();
 
-    void *percpu_copy = (void *)vbrk;
-
-    vbrk = map_percpu(vbrk);
-    set_percpu_start(percpu_copy);
+    set_percpu_start(percpu_copy());
 
     kvmalloc_init();
 
@@ -1,21 +1,52 @@
 #include "kvmalloc.h"
+#include "config.h"
+#include "cpu.h"
 #include "spinlock.h"
 #include "die.h"
 #include "macros.h"
 #include "memory.h"
 #include "memory_map.h"
 #include "kconsole.h"
+#include "list.h"
 #include "pltfrm.h"
 #include "prot.h"
 #include "rbt.h"
 #include "vmap.h"
 
 static uintptr_t heap_start, heap_end;
-static uintptr_t heap_meta_start, heap_meta_current;
 static uintptr_t pheap;
 static volatile spinlock_t vmalloc_lock;
 static struct rb_node *root_node;
 
+// Each cpu owns a fixed window at the bottom of the kernel heap and hands out small ranges from it
+// without taking vmalloc_lock. A range never straddles two bitfields, so one CAS claims it.
+#define KVA_CACHE_PAGES 1024
+#define KVA_CACHE_WORDS (KVA_CACHE_PAGES / 64)
+#define KVA_CACHE_MAX_PAGES 16
+
+#define KVA_CACHE_BEGIN KERNEL_HEAP_BEGIN
+#define KVA_CACHE_END (KVA_CACHE_BEGIN + (uintptr_t)MAX_CPUS * KVA_CACHE_PAGES * PAGE_SIZE)
+
+struct kva_cache {
+    // bit i set -> page i of the window is in use.
+    uint64_t used[KVA_CACHE_WORDS];
+    // bit i set -> page i is the last page of an allocated range.
+    uint64_t ends[KVA_CACHE_WORDS];
+    // where the owner starts scanning. only a hint, so races on it are harmless.
+    uint32_t hint;
+};
+
+// not per-cpu storage because any cpu may free a range back to its owner.
+static struct kva_cache kva_caches[MAX_CPUS];
+
+// ranges unmapped by kvfree_lazy whose tlb entries may still be live somewhere.
+#define LAZY_MAX_RANGES 64
+#define LAZY_MAX_PAGES 1024
+
+static volatile spinlock_t lazy_lock;
+static void *lazy_ranges[LAZY_MAX_RANGES];
+static size_t num_lazy_ranges, num_lazy_pages;
+
 // TODO: Abstract this nonsense into an rbt user.
 struct va_range {
     uintptr_t base, size;
@@ -27,9 +58,13 @@ struct vma_node {
 };
 
 #define NUM_BITFIELDS ((PAGE_SIZE / sizeof(struct vma_node) + 63) / 64)
-#define NUM_NODES ((PAGE_SIZE - 8 * NUM_BITFIELDS) / sizeof(struct vma_node))
 
 struct slab {
+    // links this slab into partial_slabs while it has at least one free node.
+    struct list_head partial_node;
+    uint32_t free_count;
+    // no bitfield below this index has a free bit.
+    uint32_t hint;
     // some ceiling division to figure out the max bits needed to store a complete page of vma_node
     // objects. free/allocated bits correspond as follows: bitfields[n].i -> nodes[n * 64 + i]'s f/a
     // (0/1) bit
@@ -38,38 +73,62 @@ struct slab {
     struct vma_node nodes[];
 };
 
-static struct slab *bump_meta(void) {
-    uintptr_t old = heap_meta_current;
+#define NUM_NODES ((PAGE_SIZE - sizeof(struct slab)) / sizeof(struct vma_node))
 
-    struct slab *slab = (struct slab *)old;
-    heap_meta_current += PAGE_SIZE;
+static LIST_HEAD(partial_slabs);
+// how many of partial_slabs have every node free. free_node keeps it at 1 at most.
+static size_t empty_slabs;
 
+// slabs live in the direct map, so getting one is just a page allocation.
+static struct slab *bump_meta(void) {
     uintptr_t pa;
     int f;
     if ((f = global_acquire_pages(1, &pa, NULL)) == -1) {
         KFATAL("global_acquire_pages: %d\n", f);
     }
 
-    if ((f = vmap(old, pa, PROT_RSYS | PROT_WSYS, MEMORY_TYPE_NORMAL, 0)) == -1) {
-        KFATAL("vmap: %d\n", f);
-    }
+    struct slab *slab = phys_to_virt(pa);
 
     clear_memory(slab->bitfields, sizeof(slab->bitfields));
 
+    // mark the bits past the last node as allocated so that the scan never hands them out.
+    for (size_t j = NUM_NODES; j < NUM_BITFIELDS * 64; j++) {
+        slab->bitfields[j / 64] |= (uint64_t)1 << (j % 64);
+    }
+
+    slab->free_count = NUM_NODES;
+    slab->hint = 0;
+    list_add_head(&slab->partial_node, &partial_slabs);
+    empty_slabs++;
+
     return slab;
 }
 
+static void release_meta(struct slab *slab) {
+    list_del(&slab->partial_node);
+    global_release_block(virt_to_phys(slab));
+}
+
 static struct vma_node *allocate_from_slab(struct slab *slab) {
-    for (uint32_t j = 0; j < NUM_NODES; j++) {
-        uint32_t major = j / 64;
-        uint32_t minor = j % 64;
+    for (uint32_t major = slab->hint; major < NUM_BITFIELDS; major++) {
+        uint64_t free_bits = ~slab->bitfields[major];
+
+        if (free_bits) {
+            uint32_t minor = __builtin_ctzll(free_bits);
 
-        uint64_t mask = (uint64_t)1 << minor;
-        if (!(slab->bitfields[major] & mask)) {
-            // free, so
             // make allocated
-            slab->bitfields[major] |= mask;
-            return slab->nodes + j;
+            slab->bitfields[major] |= (uint64_t)1 << minor;
+            slab->hint = major;
+
+            if (slab->free_count == NUM_NODES) {
+                empty_slabs--;
+            }
+
+            if (--slab->free_count == 0) {
+                list_del(&slab->partial_node);
+            }
+
+            return slab->nodes + major * 64 + minor;
         }
     }
 
@@ -77,17 +136,15 @@ static struct vma_node *allocate_from_slab(struct slab *slab) {
 }
 
 static struct vma_node *allocate_node(void) {
-    for (uintptr_t x = heap_meta_start; x < heap_meta_current; x += PAGE_SIZE) {
-        struct slab *slab = (struct slab *)x;
-        struct vma_node *node = allocate_from_slab(slab);
-        if (node)
-            return node;
-    }
+    struct slab *slab;
 
-    // TODO: Check that we haven't exceeded the metadata restriction (KERNEL_HEAP_BEGIN)
+    if (list_empty(&partial_slabs)) {
+        slab = bump_meta();
+    } else {
+        slab = LIST_ELEMENT(partial_slabs.next, struct slab, partial_node);
+    }
 
-    struct slab *new_slab = bump_meta();
-    return allocate_from_slab(new_slab);
+    return allocate_from_slab(slab);
 }
 
 static void free_node(struct vma_node *node) {
@@ -101,6 +158,24 @@ static void free_node(struct vma_node *node) {
     size_t minor = index % 64;
 
     slab->bitfields[major] &= ~((uint64_t)1 << minor);
+
+    if (major < slab->hint) {
+        slab->hint = major;
+    }
+
+    if (slab->free_count++ == 0) {
+        list_add_head(&slab->partial_node, &partial_slabs);
+    }
+
+    // keep one empty slab around so that alternating allocations and frees don't keep acquiring
+    // and releasing the same page.
+    if (slab->free_count == NUM_NODES) {
+        if (empty_slabs) {
+            release_meta(slab);
+        } else {
+            empty_slabs++;
+        }
+    }
 }
 
 void vma_tree_insert(struct rb_node **root, struct vma_node *node) {
@@ -177,7 +252,7 @@ int inorder_traverse_find_free_space(struct rb_node *root, size_t bytes, uintptr
     struct rb_node *prev = NULL;
     struct rb_node *curr = root;
 
-    uintptr_t start = KERNEL_HEAP_BEGIN;
+    uintptr_t start = heap_start;
 
     while (curr != NULL) {
         struct rb_node *next;
@@ -213,7 +288,7 @@ int inorder_traverse_find_free_space(struct rb_node *root, size_t bytes, uintptr
         curr = next;
     }
 
-    if (start + bytes < KERNEL_HEAP_END) {
+    if (start + bytes < heap_end) {
         *out = start;
         return 1;
     }
@@ -238,20 +313,112 @@ static void *request_pages(size_t pages) {
     return NULL;
 }
 
+// returns a mask whose set bits are the positions at which 'pages' consecutive clear bits of
+// 'used' begin.
+static uint64_t find_free_runs(uint64_t used, size_t pages) {
+    uint64_t runs = ~used;
+    size_t len = 1;
+
+    while (runs && len < pages) {
+        size_t step = KMIN(len, pages - len);
+        runs &= runs >> step;
+        len += step;
+    }
+
+    return runs;
+}
+
+static void *kva_cache_alloc(cpu_t cpu, size_t pages) {
+    struct kva_cache *cache = &kva_caches[cpu];
+    uint64_t mask = ((uint64_t)1 << pages) - 1;
+    uint32_t first = cache->hint;
+
+    for (uint32_t i = 0; i < KVA_CACHE_WORDS; i++) {
+        uint32_t word = (first + i) % KVA_CACHE_WORDS;
+        uint64_t used = __atomic_load_n(&cache->used[word], __ATOMIC_RELAXED);
+        uint64_t runs;
+
+        while ((runs = find_free_runs(used, pages))) {
+            uint32_t bit = __builtin_ctzll(runs);
+
+            // on failure, 'used' is reloaded and we look again.
+            if (__atomic_compare_exchange_n(&cache->used[word], &used, used | (mask << bit), false,
+                                            __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+                __atomic_fetch_or(&cache->ends[word], (uint64_t)1 << (bit + pages - 1),
+                                  __ATOMIC_RELAXED);
+                cache->hint = word;
+
+                size_t page = (size_t)cpu * KVA_CACHE_PAGES + word * 64 + bit;
+                return (void *)(KVA_CACHE_BEGIN + page * PAGE_SIZE);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+// may be called from any cpu, not just the owner of the window.
+static void kva_cache_free(uintptr_t address) {
+    size_t index = (address - KVA_CACHE_BEGIN) / PAGE_SIZE;
+    struct kva_cache *cache = &kva_caches[index / KVA_CACHE_PAGES];
+
+    uint32_t word = (index % KVA_CACHE_PAGES) / 64;
+    uint32_t bit = index % 64;
+
+    uint64_t all_ends = __atomic_load_n(&cache->ends[word], __ATOMIC_RELAXED);
+    uint64_t ends = all_ends >> bit;
+    uint64_t used = __atomic_load_n(&cache->used[word], __ATOMIC_RELAXED);
+
+    // ranges never cross a word, so address starts one only if the page before it (in the same
+    // word) is free or ends another range. anything else is the middle of an allocation.
+    uint64_t prev = bit ? (uint64_t)1 << (bit - 1) : 0;
+    bool starts_range = !prev || !(used & prev) || (all_ends & prev);
+
+    if (!ends || !(used & ((uint64_t)1 << bit)) || !starts_range) {
+        KFATAL("Returning non-returnable virtual memory area.\n");
+    }
+
+    size_t pages = __builtin_ctzll(ends) + 1;
+    uint64_t mask = ((uint64_t)1 << pages) - 1;
+
+    // clear the end marker first, so that whoever claims these pages next starts from a clean slate.
+    __atomic_fetch_and(&cache->ends[word], ~((uint64_t)1 << (bit + pages - 1)), __ATOMIC_RELAXED);
+    __atomic_fetch_and(&cache->used[word], ~(mask << bit), __ATOMIC_RELEASE);
+}
+
 void kvmalloc_init(void) {
-    heap_start = KERNEL_HEAP_BEGIN;
+    heap_start = KVA_CACHE_END;
     heap_end = KERNEL_HEAP_END;
 
     pheap = KERNEL_PERMANENT_HEAP_BEGIN;
-
-    heap_meta_current = heap_meta_start = KERNEL_HEAP_META_BEGIN;
 }
 
 void *kvmalloc(size_t pages, int flags) {
+    if (!(flags & KVMALLOC_PERMANENT) && pages && pages <= KVA_CACHE_MAX_PAGES) {
+        // this_cpu() is invalid until the cpus have been enumerated.
+        cpu_t cpu = this_cpu();
+
+        if (cpu < MAX_CPUS) {
+            void *ret = kva_cache_alloc(cpu, pages);
+            if (ret) {
+                return ret;
+            }
+        }
+    }
+
     spin_lock_irq(&vmalloc_lock);
     void *ret;
     if (!(flags & KVMALLOC_PERMANENT)) {
         ret = request_pages(pages);
+
+        if (!ret && num_lazy_ranges) {
+            // lazily freed ranges might be what's in the way.
+            spin_unlock_irq(&vmalloc_lock);
+            kvfree_lazy_purge();
+            spin_lock_irq(&vmalloc_lock);
+
+            ret = request_pages(pages);
+        }
     } else {
         ret = (void *)pheap;
         pheap += pages * PAGE_SIZE;
@@ -262,9 +429,53 @@ void *kvmalloc(size_t pages, int flags) {
 }
 
 void kvfree(void *ptr) {
+    uintptr_t address = (uintptr_t)ptr;
+
+    if (address >= KVA_CACHE_BEGIN && address < KVA_CACHE_END) {
+        kva_cache_free(address);
+        return;
+    }
+
     spin_lock_irq(&vmalloc_lock);
 
-    return_pages((uintptr_t) ptr);
+    return_pages(address);
 
     spin_unlock_irq(&vmalloc_lock);
 }
+
+// WARNING: lazy_lock must be held. takes vmalloc_lock, so never call kvfree_lazy with it held.
+static void purge_lazy_ranges(void) {
+    if (!num_lazy_ranges) {
+        return;
+    }
+
+    tlb_flush();
+
+    for (size_t i = 0; i < num_lazy_ranges; i++) {
+        kvfree(lazy_ranges[i]);
+    }
+
+    num_lazy_ranges = 0;
+    num_lazy_pages = 0;
+}
+
+void kvfree_lazy(void *ptr, size_t pages) {
+    vumap_range_noflush((uintptr_t)ptr, pages);
+
+    spin_lock_irq(&lazy_lock);
+
+    lazy_ranges[num_lazy_ranges++] = ptr;
+    num_lazy_pages += pages;
+
+    if (num_lazy_ranges == LAZY_MAX_RANGES || num_lazy_pages >= LAZY_MAX_PAGES) {
+        purge_lazy_ranges();
+    }
+
+    spin_unlock_irq(&lazy_lock);
+}
+
+void kvfree_lazy_purge(void) {
+    spin_lock_irq(&lazy_lock);
+    purge_lazy_ranges();
+    spin_unlock_irq(&lazy_lock);
+}
@@ -16,4 +16,12 @@ void kvmalloc_init(void);
 void *kvmalloc(size_t pages, int flags);
 void kvfree(void *ptr);
 
+/* unmaps the 'pages' pages at ptr (skipping any that aren't mapped) and frees the range, without
+   invalidating the tlb right away. the range is parked until enough stale pages have accumulated, and then every parked range is
+   flushed at once and returned. a parked range is never handed out before it has been flushed. */
+void kvfree_lazy(void *ptr, size_t pages);
+
+// flushes and returns every range parked by kvfree_lazy.
+void kvfree_lazy_purge(void);
+
 #endif
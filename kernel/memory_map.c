@@ -5,6 +5,8 @@
 #include "macros.h"
 #include "kconsole.h"
 #include "pltfrm.h"
+#include "prot.h"
+#include "vmap.h"
 
 /* physical address range for the memory map */
 char *memory_map_phys_start, *memory_map_phys_end;
@@ -14,6 +16,9 @@ char *memory_map_addr_start, *memory_map_addr_end;
 
 spinlock_t mm_lock;
 
+// 0 until the direct map is up, so that early page-table code goes through the identity map.
+static uintptr_t direct_map_offset;
+
 static int ranges_overlap(uintptr_t a_start, uintptr_t a_end, uintptr_t b_start, uintptr_t b_end);
 
 void trickle_up_allocate_pages(struct buddy_allocator *alloc, uint64_t page_first,
@@ -69,6 +74,31 @@ void reserve_active_kernel_memory(void) {
     }
 }
 
+void direct_map_init(void) {
+    for (struct heap_data *heap = (struct heap_data *)memory_map_addr_start; heap->pages; heap++) {
+        if (heap->addr + heap->pages * PAGE_SIZE > DIRECT_MAP_END - DIRECT_MAP_BEGIN) {
+            KFATAL("Heap at 0x%lx is beyond the reach of the direct map.\n", heap->addr);
+        }
+
+        // nothing has been mapped here before, so there's nothing to flush.
+        int r = vmap_range(DIRECT_MAP_BEGIN + heap->addr, heap->addr, heap->pages,
+                           PROT_RSYS | PROT_WSYS, MEMORY_TYPE_NORMAL, VMAP_FLAG_NO_FLUSH);
+        if (r < 0) {
+            KFATAL("Failed to map heap at 0x%lx into the direct map: %d\n", heap->addr, r);
+        }
+    }
+
+    __atomic_store_n(&direct_map_offset, DIRECT_MAP_BEGIN, __ATOMIC_RELEASE);
+}
+
+void *phys_to_virt(uintptr_t pa) {
+    return (void *)(pa + __atomic_load_n(&direct_map_offset, __ATOMIC_RELAXED));
+}
+
+uintptr_t virt_to_phys(const void *va) {
+    return (uintptr_t)va - __atomic_load_n(&direct_map_offset, __ATOMIC_RELAXED);
+}
+
 /* pre: a_end != a_start && b_end != b_start */
 int ranges_overlap(uintptr_t a_start, uintptr_t a_end, uintptr_t b_start, uintptr_t b_end) {
     return (a_start < b_end) && (b_start < a_end);
@@ -461,3 +491,15 @@ void global_release_block(uintptr_t region_start) {
 
     KFATAL("Region beginning at 0x%lx does not belong to any existing heap.\n", region_start);
 }
+
+struct page *phys_to_page(uintptr_t pa) {
+    for (struct heap_data *heap = (struct heap_data *)memory_map_addr_start; heap->pages; heap++) {
+        if (heap->addr > pa || pa >= heap->addr + heap->pages * PAGE_SIZE) {
+            continue;
+        }
+
+        return HEAP_FIRST_PAGE(heap) + (pa - heap->addr) / PAGE_SIZE;
+    }
+
+    return NULL;
+}
@@ -7,6 +7,14 @@
 void reserve_active_kernel_memory(void);
 void vmap_memory_map(void);
 
+/* maps every heap at DIRECT_MAP_BEGIN + pa, with blocks wherever alignment allows. until this has
+   run, phys_to_virt only works for what the boot identity map covers. */
+void direct_map_init(void);
+
+/* the direct map address of pa, which needs no mapping or tlb maintenance to use. */
+void *phys_to_virt(uintptr_t pa);
+uintptr_t virt_to_phys(const void *va);
+
 /* returns -1 on failure, 0 on success */
 int acquire_block(struct buddy_allocator * _Nonnull alloc, uint64_t order, uintptr_t * _Nonnull region_start, uintptr_t * _Nullable region_end);
 void release_block(struct buddy_allocator * _Nonnull alloc, uintptr_t region_start);
@@ -20,6 +28,9 @@ int global_acquire_bytes(uint64_t bytes, uintptr_t * _Nonnull region_start, uint
 
 void global_release_block(uintptr_t region_start);
 
+/* returns the struct page describing the physical page at pa, or NULL if pa isn't in any heap */
+struct page *phys_to_page(uintptr_t pa);
+
 void dump_memory_map(uint64_t min_order, uint64_t max_order);
 void dump_allocated_blocks(struct heap_data *heap, uint64_t order);
 
@@ -358,3 +358,38 @@ unlink:;
                      : root;
     *pnode = NULL;
 }
+
+struct rb_node *rb_next(struct rb_node *node) {
+    if (node->right) {
+        return least_greater(node);
+    }
+
+    struct rb_node *parent = get_parent(node);
+
+    while (parent && node == parent->right) {
+        node = parent;
+        parent = get_parent(node);
+    }
+
+    return parent;
+}
+
+void rb_insert_color_cached(struct rb_node *node, struct rb_root_cached *root, bool leftmost) {
+    if (leftmost) {
+        root->leftmost = node;
+    }
+
+    rb_insert_color(node, &root->root);
+}
+
+struct rb_node *rb_del_cached(struct rb_node *node, struct rb_root_cached *root) {
+    // rb_del moves nodes around, but never changes their order, so the successor stays the
+    // successor.
+    if (root->leftmost == node) {
+        root->leftmost = rb_next(node);
+    }
+
+    rb_del(node, &root->root);
+
+    return root->leftmost;
+}
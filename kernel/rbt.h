@@ -20,8 +20,22 @@ struct rb_node {
     struct rb_node *left, *right;
 };
 
+// A tree that also keeps track of its leftmost (least) node, so finding it is O(1).
+struct rb_root_cached {
+    struct rb_node *root;
+    struct rb_node *leftmost;
+};
+
 void rb_link_node(struct rb_node *node, struct rb_node *parent, struct rb_node **pnode);
 void rb_insert_color(struct rb_node *node, struct rb_node **root);
 void rb_del(struct rb_node *node, struct rb_node **root);
 
+// The next node in order, or NULL.
+struct rb_node *rb_next(struct rb_node *node);
+
+// leftmost: whether node was linked as the new least node (the search only ever went left).
+void rb_insert_color_cached(struct rb_node *node, struct rb_root_cached *root, bool leftmost);
+// Returns the new leftmost node.
+struct rb_node *rb_del_cached(struct rb_node *node, struct rb_root_cached *root);
+
 #endif
@@ -1,17 +1,120 @@
 #include "sched.h"
+#include "kconsole.h"
 #include "kmalloc.h"
+#include "memory.h"
 #include "spinlock.h"
 #include "task.h"
 
-#define run_queue_root GET_PERCPU(__pcpu_run_queue_root)
+// at most this many tasks are pulled in one balancing pass.
+#define BALANCE_MAX_MOVES 8
+
+// deadline utilizations (runtime / period) are fixed point with this many fractional bits.
+#define DL_UTIL_SHIFT 20
+
+/* fair entities queued by vruntime: each cpu's top level, and every group's share of each cpu.
+   only changed with that cpu's run queue lock held. */
+struct cfs_rq {
+    struct rb_root_cached tasks;
+    // the vruntime of the leftmost entity, last time there was one.
+    time_t min_vruntime;
+
+    // the summed weights of the queued entities.
+    uint64_t load;
+    uint32_t nr_queued;
+
+    // the group entity this queue belongs to, NULL at the top level.
+    struct sched_entity *se;
+
+    // set while a task under it runs. se is kept off its parent's queue until that stops.
+    bool running;
+};
+
+struct task_group {
+    uint32_t weight;
+
+    struct {
+        struct sched_entity se;
+        struct cfs_rq cfs_rq;
+    } cpus[MAX_CPUS];
+};
+
+// the top level. only its queues are used.
+static struct task_group root_group;
+
+struct run_queue {
+    // the owning cpu changes the queue with it held, and so does a balancer pulling from it.
+    volatile spinlock_t lock;
+
+    // every queued fair task, whatever group it's in. the queues themselves are in root_group.
+    struct list_head fair_tasks;
+
+    // the queue of the running fair task, whose groups are off their parents' queues until it
+    // stops.
+    struct cfs_rq *curr_cfs;
+
+    // the summed weights of the queued fair tasks and how many there are, and the weight of the
+    // running task. the loads are read without the lock by balancers on other cpus.
+    uint64_t queued_load, running_load;
+    uint32_t nr_queued;
+
+    // the running task's slice, in timer counts.
+    uint32_t slice;
+
+    // the running task's vruntime and the time it was picked, so that a waker on any cpu can tell
+    // how far along it is without touching the task.
+    time_t curr_vruntime, curr_start;
+
+    // a task queued here should run before the current one. acted on when an interrupt returns.
+    bool need_resched;
+
+    // queued rt tasks, a fifo list per rt_prio, with the bit for each non-empty list set in
+    // rt_bitmap.
+    struct list_head rt_lists[RT_PRIO_LEVELS];
+    uint64_t rt_bitmap[BITS_TO_U64S(RT_PRIO_LEVELS)];
+    uint32_t rt_nr_queued;
+
+    // the running task's rt_prio, or -1 if it isn't an rt task.
+    prio_t curr_rt_prio;
+
+    // time spent running rt tasks in the throttling period that began at rt_period_start.
+    time_t rt_time, rt_period_start;
+
+    // set by sched_yield, so that a yielding rt task goes to the back of its list.
+    bool rt_yield;
+
+    // queued deadline tasks ordered by absolute deadline, and those throttled until their next
+    // period.
+    struct rb_root_cached dl_tasks;
+    struct list_head dl_throttled;
+
+    // the summed dl_util of the deadline tasks admitted here. changed with the lock held.
+    uint64_t dl_util;
+
+    // whether the running task is a deadline task, and if so its absolute deadline.
+    bool curr_dl;
+    time_t curr_deadline;
+
+    /* set while the cpu runs without a tick, whether idle or nohz_full with a single task. whoever
+       clears it owes the cpu a SCHED_MESSAGE_RESCHEDULE. */
+    bool tick_stopped;
+
+    // times this cpu ran dry and took a task from another queue, and times it found tasks queued
+    // elsewhere but couldn't take any. only written by the owning cpu.
+    uint64_t steals, failed_steals;
+
+    cpu_t cpu;
+};
+
+#define this_rq GET_PERCPU(__pcpu_run_queue)
 #define blocked_list GET_PERCPU(__pcpu_blocked_list)
 #define suspended_list GET_PERCPU(__pcpu_suspended_list)
-#define min_vruntime GET_PERCPU(__pcpu_min_vruntime)
 
-static PERCPU_UNINIT struct rb_node *__pcpu_run_queue_root;
+static PERCPU_UNINIT struct run_queue __pcpu_run_queue;
 static PERCPU_INIT struct list_head __pcpu_blocked_list = LIST_HEAD_INIT(__pcpu_blocked_list),
                                     __pcpu_suspended_list = LIST_HEAD_INIT(__pcpu_suspended_list);
-static PERCPU_UNINIT time_t __pcpu_min_vruntime;
+
+// every cpu's run queue, for balancing. NULL until the cpu has called sched_init_cpu.
+static struct run_queue *run_queues[MAX_CPUS];
 
 void wait_queue_insert(struct list_head *wait_head, struct task *task) {
     task_ref_inc(task);
@@ -23,28 +126,23 @@ void wait_queue_del(struct task *task) {
     list_del(&task->wait_queue_node);
 }
 
-static struct rb_node *get_leftmost_node(void) {
-    struct rb_node *current = run_queue_root;
-
-    if (!current) {
-        return NULL;
-    }
-
-    while (current->left) {
-        current = current->left;
-    }
+static struct sched_entity *node_entity(struct rb_node *node) {
+    return node ? CONTAINER_OF(node, struct sched_entity, run_queue_node) : NULL;
+}
 
-    return current;
+static struct task *entity_task(struct sched_entity *se) {
+    return se ? CONTAINER_OF(CONTAINER_OF(se, struct sched_node, se), struct task, sched_node)
+              : NULL;
 }
 
-static void update_min_vruntime(void) {
-    struct rb_node *node = get_leftmost_node();
-    if (!node)
-        return;
+static struct task *fair_list_task(struct list_head *node) {
+    return CONTAINER_OF(CONTAINER_OF(node, struct sched_node, fair_node), struct task, sched_node);
+}
 
-    struct task *task = CONTAINER_OF(CONTAINER_OF(node, struct sched_node, run_queue_node),
-                                     struct task, sched_node);
-    min_vruntime = task->vruntime;
+static void update_min_vruntime(struct cfs_rq *q) {
+    if (q->tasks.leftmost) {
+        q->min_vruntime = node_entity(q->tasks.leftmost)->vruntime;
+    }
 }
 
 inline static bool vruntime_before(time_t a, time_t b) {
@@ -111,46 +209,389 @@ inline static bool vruntime_before(time_t a, time_t b) {
     return (a != b) && ((a - b) >= (UINT64_MAX / 2));
 }
 
-static void run_queue_insert(struct task *task) {
-    struct rb_node *rb = &task->sched_node.run_queue_node;
+static uint64_t us_to_counts(uint64_t us) { return us * timer_gethz() / 1000000; }
+
+static bool task_is_rt(struct task *task) {
+    return task->policy == SCHED_POLICY_FIFO || task->policy == SCHED_POLICY_RR;
+}
+
+static bool task_is_dl(struct task *task) { return task->policy == SCHED_POLICY_DEADLINE; }
+
+static struct task *rt_node_task(struct list_head *node) {
+    return CONTAINER_OF(CONTAINER_OF(node, struct sched_node, rt_node), struct task, sched_node);
+}
+
+/* whether a running rt task being put back keeps its place at the front of its list: it does
+   unless it yielded, or is round robin and has used up its slice. rq->lock must be held. */
+static bool rt_keeps_place(struct run_queue *rq, struct task *task) {
+    if (rq != &this_rq || task != current_task || rq->rt_yield) {
+        return false;
+    }
+
+    return task->policy == SCHED_POLICY_FIFO ||
+           timer_get_phys() - rq->curr_start < us_to_counts(SCHED_RR_TIMESLICE_US);
+}
+
+// WARNING: rq->lock must be held.
+static void rt_insert(struct run_queue *rq, struct task *task) {
+    prio_t prio = task->rt_prio;
+
+    if (rt_keeps_place(rq, task)) {
+        list_add_head(&task->sched_node.rt_node, &rq->rt_lists[prio]);
+    } else {
+        list_add_tail(&task->sched_node.rt_node, &rq->rt_lists[prio]);
+    }
+
+    rq->rt_bitmap[prio / 64] |= 1ULL << (prio % 64);
+    rq->rt_nr_queued++;
+}
+
+// WARNING: rq->lock must be held.
+static void rt_del(struct run_queue *rq, struct task *task) {
+    prio_t prio = task->rt_prio;
+
+    list_del(&task->sched_node.rt_node);
+
+    if (list_empty(&rq->rt_lists[prio])) {
+        rq->rt_bitmap[prio / 64] &= ~(1ULL << (prio % 64));
+    }
+
+    rq->rt_nr_queued--;
+}
+
+// the first task on the highest priority non-empty rt list. rq->lock must be held.
+static struct task *rt_pick(struct run_queue *rq) {
+    for (size_t i = ARRAY_LEN(rq->rt_bitmap); i-- > 0;) {
+        if (rq->rt_bitmap[i]) {
+            prio_t prio = i * 64 + 63 - __builtin_clzll(rq->rt_bitmap[i]);
+            return rt_node_task(rq->rt_lists[prio].next);
+        }
+    }
+
+    return NULL;
+}
+
+// whether the rt tasks here have used up their share of the current period.
+static bool rt_throttled(struct run_queue *rq) {
+    return rq->rt_time >= us_to_counts(SCHED_RT_RUNTIME_US);
+}
+
+static struct task *dl_node_task(struct rb_node *node) {
+    return node ? CONTAINER_OF(CONTAINER_OF(node, struct sched_node, dl_node), struct task,
+                               sched_node)
+                : NULL;
+}
 
+static struct task *dl_throttled_task(struct list_head *node) {
+    return CONTAINER_OF(CONTAINER_OF(node, struct sched_node, dl_throttled_node), struct task,
+                        sched_node);
+}
+
+// when task's next period starts.
+static time_t dl_next_period(struct task *task) {
+    struct sched_node *dl = &task->sched_node;
+    return dl->dl_abs_deadline - dl->dl_deadline + dl->dl_period;
+}
+
+// WARNING: rq->lock must be held.
+static void dl_enqueue(struct run_queue *rq, struct task *task) {
     struct rb_node *parent = NULL;
-    struct rb_node **current = &run_queue_root;
+    struct rb_node **current = &rq->dl_tasks.root;
+    bool leftmost = true;
+
+    while (*current) {
+        parent = *current;
+
+        // vruntime_before works just as well on any other times that are kept close together.
+        if (vruntime_before(task->sched_node.dl_abs_deadline,
+                            dl_node_task(*current)->sched_node.dl_abs_deadline)) {
+            current = &(*current)->left;
+        } else {
+            current = &(*current)->right;
+            leftmost = false;
+        }
+    }
+
+    rb_link_node(&task->sched_node.dl_node, parent, current);
+    rb_insert_color_cached(&task->sched_node.dl_node, &rq->dl_tasks, leftmost);
+}
 
-    if (vruntime_before(task->vruntime, min_vruntime)) {
-        task->vruntime = min_vruntime;
+/* queues a deadline task, or throttles it if it has used up this period's runtime. a task whose
+   deadline has passed, or that couldn't use up the rest of its runtime by then without going over
+   its bandwidth, gets a fresh deadline and runtime as of now: the cbs wakeup rule.
+   WARNING: rq->lock must be held. */
+static void dl_insert(struct run_queue *rq, struct task *task) {
+    struct sched_node *dl = &task->sched_node;
+    time_t now = timer_get_phys();
+
+    if (!dl->dl_budget && vruntime_before(now, dl_next_period(task))) {
+        dl->dl_throttled = true;
+        list_add_tail(&dl->dl_throttled_node, &rq->dl_throttled);
+        return;
+    }
+
+    if (!vruntime_before(now, dl->dl_abs_deadline) ||
+        dl->dl_budget * dl->dl_period > dl->dl_runtime * (dl->dl_abs_deadline - now)) {
+        dl->dl_abs_deadline = now + dl->dl_deadline;
+        dl->dl_budget = dl->dl_runtime;
+    }
+
+    dl_enqueue(rq, task);
+}
+
+// WARNING: rq->lock must be held.
+static void dl_del(struct run_queue *rq, struct task *task) {
+    struct sched_node *dl = &task->sched_node;
+
+    if (dl->dl_throttled) {
+        list_del(&dl->dl_throttled_node);
+        dl->dl_throttled = false;
+    } else {
+        rb_del_cached(&dl->dl_node, &rq->dl_tasks);
+    }
+}
+
+// requeues the throttled deadline tasks whose next period has begun. rq->lock must be held.
+static void dl_replenish(struct run_queue *rq, time_t now) {
+    struct list_head *node = rq->dl_throttled.next;
+
+    while (node != &rq->dl_throttled) {
+        struct task *task = dl_throttled_task(node);
+        struct sched_node *dl = &task->sched_node;
+        node = node->next;
+
+        time_t start = dl_next_period(task);
+        if (vruntime_before(now, start)) {
+            continue;
+        }
+
+        list_del(&dl->dl_throttled_node);
+        dl->dl_throttled = false;
+
+        dl->dl_abs_deadline = start + dl->dl_deadline;
+        dl->dl_budget = dl->dl_runtime;
+        dl_enqueue(rq, task);
+    }
+}
+
+// timer counts until the first throttled deadline task is due back, or 0 if there are none.
+static uint64_t dl_until_replenish(struct run_queue *rq, time_t now) {
+    uint64_t until = 0;
+
+    LIST_FOREACH(&rq->dl_throttled, node) {
+        time_t start = dl_next_period(dl_throttled_task(node));
+        uint64_t t = vruntime_before(now, start) ? start - now : 1;
+
+        if (!until || t < until) {
+            until = t;
+        }
+    }
+
+    return until;
+}
+
+// WARNING: the owning run queue's lock must be held.
+static void enqueue_entity(struct cfs_rq *q, struct sched_entity *se) {
+    struct rb_node *rb = &se->run_queue_node;
+
+    struct rb_node *parent = NULL;
+    struct rb_node **current = &q->tasks.root;
+    bool leftmost = true;
+
+    if (vruntime_before(se->vruntime, q->min_vruntime)) {
+        se->vruntime = q->min_vruntime;
     }
 
     while (*current) {
         parent = *current;
-        struct task *ctask = CONTAINER_OF(CONTAINER_OF(*current, struct sched_node, run_queue_node),
-                                          struct task, sched_node);
-        if (vruntime_before(task->vruntime, ctask->vruntime)) {
+        if (vruntime_before(se->vruntime, node_entity(*current)->vruntime)) {
             current = &(*current)->left;
-        } else if (task == ctask) {
-            // can't insert same task more than once.
-            return;
         } else {
             // On tie, prioritize guys who've been in the queue longer.
             current = &(*current)->right;
+            leftmost = false;
         }
     }
 
     rb_link_node(rb, parent, current);
-    rb_insert_color(rb, &run_queue_root);
+    rb_insert_color_cached(rb, &q->tasks, leftmost);
+
+    update_min_vruntime(q);
+
+    q->load += se->weight;
+    q->nr_queued++;
+    se->on_rq = true;
+}
 
-    update_min_vruntime();
+// WARNING: the owning run queue's lock must be held.
+static void dequeue_entity(struct cfs_rq *q, struct sched_entity *se) {
+    rb_del_cached(&se->run_queue_node, &q->tasks);
+    update_min_vruntime(q);
+
+    q->load -= se->weight;
+    q->nr_queued--;
+    se->on_rq = false;
+}
+
+// the queue task goes in on rq's cpu: its group's share of that cpu.
+static struct cfs_rq *task_cfs_rq(struct run_queue *rq, struct task *task) {
+    struct task_group *group = task->group ? task->group : &root_group;
+    return &group->cpus[rq->cpu].cfs_rq;
+}
+
+// WARNING: rq->lock must be held. returns false if task was already queued.
+static bool fair_insert(struct run_queue *rq, struct task *task) {
+    struct sched_entity *se = &task->sched_node.se;
+    struct cfs_rq *q = task_cfs_rq(rq, task);
+
+    if (se->on_rq) {
+        // can't insert same task more than once.
+        return false;
+    }
+
+    // a task changing queues (cpus or groups) keeps its lag: its distance from min_vruntime means
+    // the same in either. a new one starts out level. the old queue may be another cpu's, whose
+    // min_vruntime we read without its lock, but being a little off there is harmless.
+    if (!se->cfs_rq) {
+        se->vruntime = q->min_vruntime;
+    } else if (se->cfs_rq != q) {
+        se->vruntime = se->vruntime - se->cfs_rq->min_vruntime + q->min_vruntime;
+    }
+
+    se->cfs_rq = q;
+    enqueue_entity(q, se);
+
+    // a group joins its parent's queue along with its first queued entity, unless a task under it
+    // is running, in which case put_prev_fair puts it back.
+    for (; q->se && !q->se->on_rq && !q->running; q = q->se->cfs_rq) {
+        enqueue_entity(q->se->cfs_rq, q->se);
+    }
+
+    list_add_tail(&task->sched_node.fair_node, &rq->fair_tasks);
+
+    __atomic_store_n(&rq->queued_load, rq->queued_load + se->weight, __ATOMIC_RELAXED);
+    rq->nr_queued++;
+
+    return true;
+}
+
+// WARNING: rq->lock must be held.
+static void fair_del(struct run_queue *rq, struct task *task) {
+    struct sched_entity *se = &task->sched_node.se;
+    struct cfs_rq *q = se->cfs_rq;
+
+    dequeue_entity(q, se);
+
+    // and leaves it along with its last.
+    for (; q->se && !q->nr_queued && q->se->on_rq; q = q->se->cfs_rq) {
+        dequeue_entity(q->se->cfs_rq, q->se);
+    }
+
+    list_del(&task->sched_node.fair_node);
+
+    __atomic_store_n(&rq->queued_load, rq->queued_load - se->weight, __ATOMIC_RELAXED);
+    rq->nr_queued--;
+}
+
+// takes the groups above task off their parents' queues while it runs. rq->lock must be held.
+static void set_curr_fair(struct run_queue *rq, struct task *task) {
+    rq->curr_cfs = task->sched_node.se.cfs_rq;
+
+    for (struct cfs_rq *q = rq->curr_cfs; q->se; q = q->se->cfs_rq) {
+        q->running = true;
+
+        if (q->se->on_rq) {
+            dequeue_entity(q->se->cfs_rq, q->se);
+        }
+    }
+}
+
+/* charges the run of the fair task that was running to each group above it, by that group's
+   weight, and puts back the groups with anything still queued. rq->lock must be held. */
+static void put_prev_fair(struct run_queue *rq, time_t now) {
+    time_t delta = now - rq->curr_start;
+
+    for (struct cfs_rq *q = rq->curr_cfs; q && q->se; q = q->se->cfs_rq) {
+        q->running = false;
+        q->se->vruntime += delta * task_weight(0) / q->se->weight;
+
+        if (q->nr_queued) {
+            enqueue_entity(q->se->cfs_rq, q->se);
+        }
+    }
+
+    rq->curr_cfs = NULL;
+}
+
+// the leftmost entity at each level, from the top down to a task.
+static struct task *fair_pick(struct run_queue *rq) {
+    struct sched_entity *se = node_entity(root_group.cpus[rq->cpu].cfs_rq.tasks.leftmost);
+
+    while (se && se->my_q) {
+        se = node_entity(se->my_q->tasks.leftmost);
+    }
+
+    return entity_task(se);
+}
+
+// WARNING: rq->lock must be held.
+static void rq_insert(struct run_queue *rq, struct task *task) {
+    task->sched_node.se.weight = task_weight(task->prio);
+
+    if (task_is_dl(task)) {
+        dl_insert(rq, task);
+    } else if (task_is_rt(task)) {
+        rt_insert(rq, task);
+    } else if (!fair_insert(rq, task)) {
+        return;
+    }
 
     task_ref_inc(task);
-    task->cpu = this_cpu();
+    task->cpu = rq->cpu;
 }
 
-static void run_queue_del(struct task *task) {
-    rb_del(&task->sched_node.run_queue_node, &run_queue_root);
-    update_min_vruntime();
+// WARNING: rq->lock must be held.
+static void rq_del(struct run_queue *rq, struct task *task) {
+    if (task_is_dl(task)) {
+        dl_del(rq, task);
+    } else if (task_is_rt(task)) {
+        rt_del(rq, task);
+    } else {
+        fair_del(rq, task);
+    }
+
     task_ref_dec(task);
 }
 
+// cpu's run queue. ours is usable even before sched_init_cpu has published it.
+static struct run_queue *cpu_rq(cpu_t cpu) {
+    struct run_queue *rq = NULL;
+
+    if (cpu < MAX_CPUS) {
+        rq = __atomic_load_n(&run_queues[cpu], __ATOMIC_ACQUIRE);
+    }
+
+    return rq ? rq : &this_rq;
+}
+
+// takes task off whichever cpu's queue it's on, the one rq_insert put it on.
+static void run_queue_del(struct task *task) {
+    while (true) {
+        struct run_queue *rq = cpu_rq(task->cpu);
+        spin_lock_irq(&rq->lock);
+
+        // a balancer moves tasks with both queues locked, so once we hold this one, task->cpu
+        // can't change under us. if it did before, go after it.
+        if (task->cpu == rq->cpu) {
+            rq_del(rq, task);
+            spin_unlock_irq(&rq->lock);
+            return;
+        }
+
+        spin_unlock_irq(&rq->lock);
+    }
+}
+
 static void block(struct task *task) {
     list_add_tail(&task->sched_node.blocked_node, &blocked_list);
     task_ref_inc(task);
@@ -173,12 +614,199 @@ static void unsuspend(struct task *task) {
     task_ref_dec(task);
 }
 
+static void steal_task(struct run_queue *dst);
+
+/* task's share of the scheduling period, by weight, in timer counts. task must have just been
+   dequeued from rq, whose lock must be held. */
+static uint32_t slice_for(struct run_queue *rq, struct task *task) {
+    if (task_is_dl(task)) {
+        // the tick that ends it is what throttles it.
+        return KMIN(task->sched_node.dl_budget, UINT32_MAX);
+    }
+
+    if (task_is_rt(task)) {
+        uint64_t slice = us_to_counts(SCHED_RR_TIMESLICE_US);
+        uint64_t budget = us_to_counts(SCHED_RT_RUNTIME_US);
+
+        // the tick is what throttles it, so with normal tasks waiting it has to come by the time
+        // the budget runs out.
+        if (rq->nr_queued && rq->rt_time < budget) {
+            slice = KMIN(slice, budget - rq->rt_time);
+        }
+
+        return slice;
+    }
+
+    uint64_t period = KMAX(SCHED_LATENCY_US, (rq->nr_queued + 1) * SCHED_MIN_GRANULARITY_US);
+    uint64_t slice = period;
+
+    // its share at each level, from its own queue up through its groups'. set_curr_fair has taken
+    // them all off their queues.
+    struct sched_entity *se = &task->sched_node.se;
+    for (struct cfs_rq *q = se->cfs_rq;; se = q->se, q = se->cfs_rq) {
+        slice = slice * se->weight / (q->load + se->weight);
+
+        if (!q->se) {
+            break;
+        }
+    }
+
+    slice = KMAX(slice, SCHED_MIN_GRANULARITY_US);
+
+    return us_to_counts(slice);
+}
+
+// charges the outgoing task's run to the rt budget if it was an rt task, and starts a new period
+// once the current one is over. rq->lock must be held.
+static void rt_account(struct run_queue *rq, time_t now) {
+    if (rq->curr_rt_prio >= 0) {
+        rq->rt_time += now - rq->curr_start;
+    }
+
+    if (now - rq->rt_period_start >= us_to_counts(SCHED_RT_PERIOD_US)) {
+        rq->rt_period_start = now;
+        rq->rt_time = 0;
+    }
+}
+
+/* the deadline task with the earliest deadline, then rt tasks unless they're throttled and there's
+   a normal task waiting. */
+static struct task *pick_next(struct run_queue *rq) {
+    struct task *dl = dl_node_task(rq->dl_tasks.leftmost);
+    if (dl) {
+        return dl;
+    }
+
+    struct task *rt = rt_pick(rq);
+
+    if (rt && (!rt_throttled(rq) || !rq->nr_queued)) {
+        return rt;
+    }
+
+    return fair_pick(rq);
+}
+
+static bool nohz_full(cpu_t cpu) {
+    return cpu < 64 && ((NOHZ_FULL_CPUS >> cpu) & 1);
+}
+
+static void send_resched(struct run_queue *rq) {
+    struct sched_sgi_payload *payload = kmalloc(sizeof(*payload));
+    payload->message_type = SCHED_MESSAGE_RESCHEDULE;
+    payload->task = NULL;
+    send_sgi(rq->cpu, SCHED_SGI, payload);
+}
+
+// gets rq's cpu ticking again after a task was queued on it, if it had stopped. returns whether
+// the cpu was sent a SCHED_MESSAGE_RESCHEDULE.
+static bool kick_cpu(struct run_queue *rq) {
+    if (!__atomic_exchange_n(&rq->tick_stopped, false, __ATOMIC_ACQ_REL)) {
+        return false;
+    }
+
+    if (rq == &this_rq) {
+        // the task we're running queued another one here.
+        timer_tick_resume();
+        return false;
+    }
+
+    send_resched(rq);
+    return true;
+}
+
+/* if the running fair task, or one of the groups it's under, belongs in q (whether or not it's
+   off it while running), its vruntime as of now and its weight. rq->lock must be held. */
+static bool curr_entity_in(struct run_queue *rq, struct cfs_rq *q, time_t *vruntime,
+                           uint64_t *weight) {
+    time_t delta = timer_get_phys() - rq->curr_start;
+
+    if (q == rq->curr_cfs) {
+        *weight = rq->running_load;
+        *vruntime = rq->curr_vruntime + delta * task_weight(0) / *weight;
+        return true;
+    }
+
+    for (struct cfs_rq *c = rq->curr_cfs; c && c->se; c = c->se->cfs_rq) {
+        if (c->se->cfs_rq == q) {
+            *weight = c->se->weight;
+            *vruntime = c->se->vruntime + delta * task_weight(0) / *weight;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* whether task, just queued on rq, should preempt the task running there. between fair tasks,
+   compared where their paths up through their groups meet, it has to be behind by more than the
+   wakeup granularity, scaled to its weight there. rq->lock must be held. */
+static bool wakeup_preempts(struct run_queue *rq, struct task *task) {
+    uint64_t curr_weight = rq->running_load;
+    if (!curr_weight) {
+        // idle. if it stopped its tick, kick_cpu will see to it, but it may be ticking just to
+        // wait for a throttled deadline task.
+        return !rq->tick_stopped;
+    }
+
+    if (task_is_dl(task)) {
+        if (task->sched_node.dl_throttled) {
+            return false;
+        }
+
+        return !rq->curr_dl ||
+               vruntime_before(task->sched_node.dl_abs_deadline, rq->curr_deadline);
+    }
+
+    if (rq->curr_dl) {
+        return false;
+    }
+
+    if (task_is_rt(task)) {
+        // a throttled rt task wouldn't get picked over the normal one anyway.
+        if (rq->curr_rt_prio < 0 && rt_throttled(rq)) {
+            return false;
+        }
+
+        return task->rt_prio > rq->curr_rt_prio;
+    }
+
+    if (rq->curr_rt_prio >= 0) {
+        return false;
+    }
+
+    for (struct sched_entity *se = &task->sched_node.se;; se = se->cfs_rq->se) {
+        time_t curr;
+        uint64_t weight;
+
+        if (curr_entity_in(rq, se->cfs_rq, &curr, &weight)) {
+            time_t gran = us_to_counts(SCHED_WAKEUP_GRANULARITY_US) * task_weight(0) / se->weight;
+            return vruntime_before(se->vruntime + gran, curr);
+        }
+
+        if (!se->cfs_rq->se) {
+            // the running task isn't a fair one.
+            return false;
+        }
+    }
+}
+
 void sched_run(bool save_state) {
-    struct rb_node *node = get_leftmost_node();
-    struct task *selected =
-        node ? CONTAINER_OF(CONTAINER_OF(node, struct sched_node, run_queue_node), struct task,
-                            sched_node)
-             : NULL;
+    struct run_queue *rq = &this_rq;
+
+    // picking and dequeueing must be one step, or a balancer could pull the task in between.
+    spin_lock_irq(&rq->lock);
+
+    time_t now = timer_get_phys();
+    rt_account(rq, now);
+    put_prev_fair(rq, now);
+    dl_replenish(rq, now);
+
+    if (!rq->nr_queued && !rq->rt_nr_queued && !rq->dl_tasks.leftmost) {
+        // rather than sleep until the next balance, see if someone else has work to spare.
+        steal_task(rq);
+    }
+
+    struct task *selected = pick_next(rq);
 
     if (selected != current_task) {
         if (selected)
@@ -188,9 +816,43 @@ void sched_run(bool save_state) {
     }
 
     if (selected) {
-        run_queue_del(selected);
+        rq_del(rq, selected);
+
+        if (!task_is_rt(selected) && !task_is_dl(selected)) {
+            set_curr_fair(rq, selected);
+        }
+
+        rq->slice = slice_for(rq, selected);
+        rq->curr_vruntime = selected->sched_node.se.vruntime;
     }
 
+    rq->curr_start = now;
+    rq->curr_rt_prio = selected && task_is_rt(selected) ? selected->rt_prio : -1;
+    rq->curr_dl = selected && task_is_dl(selected);
+    rq->curr_deadline = rq->curr_dl ? selected->sched_node.dl_abs_deadline : 0;
+
+    // the tick has to bring back a throttled deadline task in time, even if nothing else runs.
+    uint64_t dl_wait = dl_until_replenish(rq, now);
+    if (dl_wait) {
+        rq->slice = KMIN(selected ? rq->slice : UINT32_MAX, dl_wait);
+    }
+
+    // whatever asked for a reschedule is getting one.
+    rq->need_resched = false;
+    rq->rt_yield = false;
+
+    __atomic_store_n(&rq->running_load, selected ? selected->sched_node.se.weight : 0,
+                     __ATOMIC_RELAXED);
+
+    // with nothing to run, or nothing to share a nohz_full cpu with, no_save_switch_to stops the
+    // tick, so from here on someone has to kick us. that's decided under the lock, so whoever
+    // queues a task here after it sees the flag.
+    bool alone = selected && !rq->nr_queued && !rq->rt_nr_queued && !rq->dl_tasks.leftmost &&
+                 !dl_wait && nohz_full(rq->cpu);
+    __atomic_store_n(&rq->tick_stopped, (!selected && !dl_wait) || alone, __ATOMIC_RELEASE);
+
+    spin_unlock_irq(&rq->lock);
+
     if (save_state) {
         save_and_switch_to(current_task, selected);
     } else {
@@ -229,9 +891,29 @@ void sched_ready_task_local(struct task *task) {
     mask_irqs();
 
     if (get_state(task) != TASK_STATE_READY) {
-        run_queue_insert(task);
+        // queue it last: once it's in a queue, another cpu may pick it up and run it.
         remove_prior(task);
         update_state(task, TASK_STATE_READY);
+
+        // a task being preempted or yielding is still running here, so it has to stay.
+        cpu_t cpu = task == current_task ? this_cpu() : select_task_cpu(task);
+        struct run_queue *rq = cpu_rq(cpu);
+
+        spin_lock_irq(&rq->lock);
+        rq_insert(rq, task);
+
+        bool preempt = task != current_task && wakeup_preempts(rq, task);
+        if (preempt) {
+            rq->need_resched = true;
+        }
+
+        spin_unlock_irq(&rq->lock);
+
+        if (task != current_task && !kick_cpu(rq) && preempt && rq != &this_rq) {
+            // we're on our way out of an interrupt if it's here. otherwise it's the other cpu's
+            // next one, which we'd rather not wait a tick for.
+            send_resched(rq);
+        }
     }
 
     restore_irq_mask(irqs);
@@ -427,12 +1109,183 @@ void sched_block_task_remote(struct task *task, struct list_head *wait_head,
 void sched_yield(void) {
     sched_preempt_disable();
 
+    int irqs = irqs_masked();
+    mask_irqs();
+
+    this_rq.rt_yield = true;
     sched_ready_task_local(current_task);
+
+    restore_irq_mask(irqs);
+
     sched_run(true);
 
     sched_preempt_enable();
 }
 
+// gives back the bandwidth task was admitted with.
+static void dl_release(struct task *task) {
+    struct run_queue *rq = cpu_rq(task->sched_node.dl_cpu);
+
+    spin_lock_irq(&rq->lock);
+    __atomic_store_n(&rq->dl_util, rq->dl_util - task->sched_node.dl_util, __ATOMIC_RELAXED);
+    spin_unlock_irq(&rq->lock);
+}
+
+/* reserves util on the least utilized cpu task may run on, if that has room for it. the current
+   task is only ever requeued on this cpu, so it's the only one it can have. */
+static cpu_t dl_admit(struct task *task, uint64_t util) {
+    uint64_t max = ((uint64_t)SCHED_DL_UTIL_MAX_PERCENT << DL_UTIL_SHIFT) / 100;
+    struct run_queue *best = NULL;
+
+    for (cpu_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        struct run_queue *rq = __atomic_load_n(&run_queues[cpu], __ATOMIC_ACQUIRE);
+
+        if (!rq || !cpu_affinity_test(&task->affinity, cpu) ||
+            (task == current_task && rq != &this_rq)) {
+            continue;
+        }
+
+        if (!best || __atomic_load_n(&rq->dl_util, __ATOMIC_RELAXED) <
+                         __atomic_load_n(&best->dl_util, __ATOMIC_RELAXED)) {
+            best = rq;
+        }
+    }
+
+    if (!best) {
+        return CPU_INVALID;
+    }
+
+    spin_lock_irq(&best->lock);
+
+    bool fits = best->dl_util + util <= max;
+    if (fits) {
+        __atomic_store_n(&best->dl_util, best->dl_util + util, __ATOMIC_RELAXED);
+    }
+
+    spin_unlock_irq(&best->lock);
+
+    return fits ? best->cpu : CPU_INVALID;
+}
+
+int sched_set_policy(struct task *task, uint32_t policy, int32_t rt_prio) {
+    if (policy > SCHED_POLICY_RR ||
+        (policy != SCHED_POLICY_NORMAL && (rt_prio < 0 || rt_prio >= RT_PRIO_LEVELS))) {
+        return -1;
+    }
+
+    int r = -1;
+
+    sched_preempt_disable();
+    int irqs = irqs_masked();
+    mask_irqs();
+
+    // a queued task would have to be moved between the lists, just don't allow it.
+    if (task == current_task || get_state(task) == TASK_STATE_NEW_BORN) {
+        if (task_is_dl(task)) {
+            dl_release(task);
+        }
+
+        task->policy = policy;
+        task->rt_prio = policy == SCHED_POLICY_NORMAL ? 0 : rt_prio;
+        r = 0;
+    }
+
+    restore_irq_mask(irqs);
+    sched_preempt_enable();
+
+    return r;
+}
+
+struct task_group *sched_create_group(struct task_group *parent, uint32_t weight) {
+    if (!weight) {
+        return NULL;
+    }
+
+    struct task_group *group = kmalloc(sizeof(*group));
+    if (!group) {
+        return NULL;
+    }
+
+    set_memory(group, 0, sizeof(*group));
+
+    group->weight = weight;
+
+    struct task_group *above = parent ? parent : &root_group;
+
+    for (cpu_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        struct sched_entity *se = &group->cpus[cpu].se;
+
+        se->weight = weight;
+        se->cfs_rq = &above->cpus[cpu].cfs_rq;
+        se->my_q = &group->cpus[cpu].cfs_rq;
+
+        group->cpus[cpu].cfs_rq.se = se;
+    }
+
+    return group;
+}
+
+int sched_set_group(struct task *task, struct task_group *group) {
+    int r = -1;
+
+    sched_preempt_disable();
+    int irqs = irqs_masked();
+    mask_irqs();
+
+    // like sched_set_policy, a queued task would have to move between queues.
+    if (task == current_task || get_state(task) == TASK_STATE_NEW_BORN) {
+        task->group = group;
+        r = 0;
+    }
+
+    restore_irq_mask(irqs);
+    sched_preempt_enable();
+
+    return r;
+}
+
+int sched_set_deadline(struct task *task, uint64_t runtime_us, uint64_t deadline_us,
+                       uint64_t period_us) {
+    if (!runtime_us || runtime_us > deadline_us || deadline_us > period_us) {
+        return -1;
+    }
+
+    uint64_t util = (runtime_us << DL_UTIL_SHIFT) / period_us;
+    int r = -1;
+
+    sched_preempt_disable();
+    int irqs = irqs_masked();
+    mask_irqs();
+
+    if ((task == current_task || get_state(task) == TASK_STATE_NEW_BORN) && !task_is_dl(task)) {
+        cpu_t cpu = dl_admit(task, util);
+
+        if (cpu != CPU_INVALID) {
+            struct sched_node *dl = &task->sched_node;
+
+            dl->dl_runtime = us_to_counts(runtime_us);
+            dl->dl_deadline = us_to_counts(deadline_us);
+            dl->dl_period = us_to_counts(period_us);
+
+            // already past, so its first period starts when it's next queued.
+            dl->dl_abs_deadline = timer_get_phys();
+            dl->dl_budget = dl->dl_runtime;
+            dl->dl_throttled = false;
+
+            dl->dl_util = util;
+            dl->dl_cpu = cpu;
+
+            task->policy = SCHED_POLICY_DEADLINE;
+            r = 0;
+        }
+    }
+
+    restore_irq_mask(irqs);
+    sched_preempt_enable();
+
+    return r;
+}
+
 void sched_preempt_disable(void) {
     if (current_task)
         current_task->preempt_counter++;
@@ -445,4 +1298,284 @@ void sched_preempt_enable(void) {
 
 bool can_preempt(void) { return !current_task || current_task->preempt_counter == 0; }
 
-time_t get_min_vruntime(void) { return min_vruntime; }
+void sched_init_cpu(void) {
+    this_rq.cpu = this_cpu();
+    this_rq.curr_rt_prio = -1;
+    list_init(&this_rq.dl_throttled);
+    list_init(&this_rq.fair_tasks);
+
+    for (size_t i = 0; i < RT_PRIO_LEVELS; i++) {
+        list_init(&this_rq.rt_lists[i]);
+    }
+
+    __atomic_store_n(&run_queues[this_cpu()], &this_rq, __ATOMIC_RELEASE);
+}
+
+static uint64_t rq_load(struct run_queue *rq) {
+    return __atomic_load_n(&rq->queued_load, __ATOMIC_RELAXED) +
+           __atomic_load_n(&rq->running_load, __ATOMIC_RELAXED);
+}
+
+cpu_t select_task_cpu(struct task *task) {
+    if (task_is_dl(task)) {
+        // its bandwidth was reserved there.
+        return task->sched_node.dl_cpu;
+    }
+
+    struct run_queue *best = NULL;
+    uint64_t best_load = UINT64_MAX;
+    bool best_nohz = true;
+
+    for (cpu_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        struct run_queue *rq = __atomic_load_n(&run_queues[cpu], __ATOMIC_ACQUIRE);
+
+        if (!rq || !cpu_affinity_test(&task->affinity, cpu)) {
+            continue;
+        }
+
+        // nohz_full cpus only get tasks that can't go anywhere else.
+        bool nohz = nohz_full(cpu);
+        if (nohz && !best_nohz) {
+            continue;
+        }
+
+        uint64_t load = rq_load(rq);
+        if (load < best_load || (best_nohz && !nohz)) {
+            best = rq;
+            best_load = load;
+            best_nohz = nohz;
+        }
+    }
+
+    if (!best) {
+        // nowhere it's allowed to go is scheduling yet.
+        return this_cpu();
+    }
+
+    // the previous cpu's caches may still hold the task's working set, which is worth up to one
+    // task's worth of extra load.
+    cpu_t prev = task->cpu;
+    if (prev < MAX_CPUS && cpu_affinity_test(&task->affinity, prev) &&
+        nohz_full(prev) == best_nohz) {
+        struct run_queue *rq = __atomic_load_n(&run_queues[prev], __ATOMIC_ACQUIRE);
+
+        if (rq && rq_load(rq) <= best_load + task_weight(task->prio)) {
+            return prev;
+        }
+    }
+
+    return best->cpu;
+}
+
+/* moves a queued task from src to dst. both locks must be held, and the task must be locked for
+   migration. */
+static void migrate_task(struct run_queue *src, struct run_queue *dst, struct task *task) {
+    // hold on to it while it's in neither queue.
+    task_ref_inc(task);
+
+    // fair_insert carries its lag over to dst's queue.
+    rq_del(src, task);
+    rq_insert(dst, task);
+
+    task_ref_dec(task);
+}
+
+/* whether task (queued on another cpu) may move to dst, which it never may against its affinity.
+   if so, it's locked for migration and the caller must end_migration once it's moved. */
+static bool begin_pull(struct task *task, struct run_queue *dst) {
+    if (!cpu_affinity_test(&task->affinity, dst->cpu)) {
+        return false;
+    }
+
+    // a yielding task is queued before its registers are saved.
+    if (__atomic_load_n(&task->on_cpu, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+
+    // a pinned task may be about to be handed to its cpu, leave it be.
+    return try_begin_migration(task);
+}
+
+// pulls tasks from src until roughly half the difference in load has moved over.
+static void pull_tasks(struct run_queue *src, struct run_queue *dst) {
+    uint64_t src_load = rq_load(src), dst_load = rq_load(dst);
+    if (src_load <= dst_load) {
+        return;
+    }
+
+    uint64_t imbalance = src_load - dst_load;
+    struct list_head *node = src->fair_tasks.next;
+
+    for (int moved = 0; node != &src->fair_tasks && moved < BALANCE_MAX_MOVES;) {
+        struct task *task = fair_list_task(node);
+
+        // list_del leaves its neighbours alone, so this is still the next one after task goes.
+        node = node->next;
+
+        // moving more than half the imbalance would just make dst the busier one.
+        uint64_t weight = task->sched_node.se.weight;
+        if (2 * weight > imbalance) {
+            continue;
+        }
+
+        if (!begin_pull(task, dst)) {
+            continue;
+        }
+
+        migrate_task(src, dst, task);
+        end_migration(task);
+
+        imbalance -= 2 * weight;
+        moved++;
+    }
+}
+
+static void kick_idle_cpu(struct run_queue *busy) {
+    for (cpu_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        struct run_queue *rq = __atomic_load_n(&run_queues[cpu], __ATOMIC_ACQUIRE);
+
+        if (!rq || rq == busy || nohz_full(cpu)) {
+            continue;
+        }
+
+        // stopped ticks with nothing running means idle.
+        if (__atomic_load_n(&rq->tick_stopped, __ATOMIC_ACQUIRE) &&
+            !__atomic_load_n(&rq->running_load, __ATOMIC_RELAXED)) {
+            kick_cpu(rq);
+            return;
+        }
+    }
+}
+
+void sched_balance(void) {
+    struct run_queue *dst = &this_rq;
+    struct run_queue *src = NULL;
+    uint64_t src_load = rq_load(dst);
+
+    if (nohz_full(dst->cpu)) {
+        // keeps to the tasks pinned here.
+        return;
+    }
+
+    for (cpu_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        struct run_queue *rq = __atomic_load_n(&run_queues[cpu], __ATOMIC_ACQUIRE);
+
+        // only queued tasks can be pulled.
+        if (rq && rq != dst && __atomic_load_n(&rq->queued_load, __ATOMIC_RELAXED) &&
+            rq_load(rq) > src_load) {
+            src = rq;
+            src_load = rq_load(rq);
+        }
+    }
+
+    if (!src) {
+        // idle cpus don't tick, so they can't come to us. if we have tasks waiting, wake one of
+        // them to steal.
+        if (__atomic_load_n(&dst->queued_load, __ATOMIC_RELAXED)) {
+            kick_idle_cpu(dst);
+        }
+
+        return;
+    }
+
+    // always lock the lower cpu's queue first, so that two cpus pulling from each other can't
+    // deadlock.
+    struct run_queue *first = src->cpu < dst->cpu ? src : dst;
+    struct run_queue *second = first == src ? dst : src;
+
+    spin_lock_irq(&first->lock);
+    spin_lock_irq(&second->lock);
+
+    pull_tasks(src, dst);
+
+    spin_unlock_irq(&second->lock);
+    spin_unlock_irq(&first->lock);
+}
+
+// takes the first task it can from one of the other queues. dst->lock must be held.
+static void steal_task(struct run_queue *dst) {
+    bool found_any = false;
+
+    if (nohz_full(dst->cpu)) {
+        return;
+    }
+
+    // start after ourselves, so that idle cpus don't all pile onto cpu 0.
+    for (cpu_t i = 1; i < MAX_CPUS; i++) {
+        struct run_queue *src = __atomic_load_n(&run_queues[(dst->cpu + i) % MAX_CPUS],
+                                                __ATOMIC_ACQUIRE);
+
+        if (!src || !__atomic_load_n(&src->queued_load, __ATOMIC_RELAXED)) {
+            continue;
+        }
+
+        found_any = true;
+
+        // we already hold our own lock, so waiting here could deadlock against a cpu doing the
+        // same to us. a busy queue is skipped instead.
+        if (!spin_trylock_irq(&src->lock)) {
+            continue;
+        }
+
+        LIST_FOREACH(&src->fair_tasks, node) {
+            struct task *task = fair_list_task(node);
+
+            if (begin_pull(task, dst)) {
+                migrate_task(src, dst, task);
+                end_migration(task);
+
+                spin_unlock_irq(&src->lock);
+                dst->steals++;
+                return;
+            }
+        }
+
+        spin_unlock_irq(&src->lock);
+    }
+
+    if (found_any) {
+        dst->failed_steals++;
+    }
+}
+
+void sched_report(void) {
+    kprint("Idle steals (cpu: taken/failed):");
+
+    for (cpu_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        struct run_queue *rq = __atomic_load_n(&run_queues[cpu], __ATOMIC_ACQUIRE);
+
+        if (rq) {
+            kprint(" %u: %lu/%lu", cpu, __atomic_load_n(&rq->steals, __ATOMIC_RELAXED),
+                   __atomic_load_n(&rq->failed_steals, __ATOMIC_RELAXED));
+        }
+    }
+
+    kprint("\n");
+}
+
+void sched_kicked(void) {
+    if (!current_task) {
+        // doesn't return if there's anything to run, and goes back to sleep if not.
+        sched_run(false);
+    }
+
+    if (__atomic_load_n(&this_rq.need_resched, __ATOMIC_RELAXED) && can_preempt()) {
+        // same as the tick preempting it, just sooner.
+        ex_save_context_to(current_task);
+        sched_ready_task_local(current_task);
+        sched_run(false);
+    }
+
+    if (sched_tick_needed()) {
+        timer_tick_resume();
+    }
+}
+
+uint32_t sched_slice(void) {
+    uint32_t slice = this_rq.slice;
+    return slice ? slice : us_to_counts(SCHED_MIN_GRANULARITY_US);
+}
+
+bool sched_tick_needed(void) {
+    return !__atomic_load_n(&this_rq.tick_stopped, __ATOMIC_ACQUIRE);
+}
@@ -7,11 +7,52 @@
 #include "time.h"
 
 struct task;
+struct cfs_rq;
+struct task_group;
 
-struct sched_node {
+// normal tasks share the cpu by vruntime. fifo and rr tasks always run before them, highest
+// rt_prio first: fifo until they block or yield, rr taking turns with their peers. deadline tasks
+// run before all of those, earliest deadline first, see sched_set_deadline.
+#define SCHED_POLICY_NORMAL 0
+#define SCHED_POLICY_FIFO 1
+#define SCHED_POLICY_RR 2
+#define SCHED_POLICY_DEADLINE 3
+
+#define RT_PRIO_LEVELS 100
+
+// what the fair class queues by vruntime: a task, or a task group's share of a cpu.
+struct sched_entity {
     struct rb_node run_queue_node;
+    // task_weight() of the task when it was queued, or the group's weight.
+    uint32_t weight;
+    time_t vruntime;
+    bool on_rq;
+
+    /* a task's is the queue it's in, or was in last, since its vruntime only means something
+       relative to that queue. NULL until it's first queued. a group's is its parent's queue. */
+    struct cfs_rq *cfs_rq;
+    // a group's own queue, NULL for a task.
+    struct cfs_rq *my_q;
+};
+
+struct sched_node {
+    struct sched_entity se;
+    // on the run queue's list of all its queued fair tasks, for the balancer.
+    struct list_head fair_node;
+    struct list_head rt_node;
     struct list_head blocked_node;
     struct list_head suspended_node;
+
+    /* deadline tasks: queued by dl_abs_deadline in dl_node, or on dl_throttled_node once
+       dl_budget has run out. the contract, in timer counts, is dl_runtime every dl_period, done
+       within dl_deadline of the period's start, and takes dl_util of dl_cpu. */
+    struct rb_node dl_node;
+    struct list_head dl_throttled_node;
+    bool dl_throttled;
+    time_t dl_runtime, dl_deadline, dl_period;
+    time_t dl_abs_deadline, dl_budget;
+    uint64_t dl_util;
+    cpu_t dl_cpu;
 };
 
 void wait_queue_insert(struct list_head *wait_head, struct task *task);
@@ -21,6 +62,7 @@ void wait_queue_del(struct task *task);
 // this function does not add current_task into the run queue..
 void sched_run(bool save_state);
 
+// readies task on the cpu select_task_cpu picks, unless it's the one running here.
 void sched_ready_task_local(struct task *task);
 void sched_suspend_task_local(struct task *task);
 
@@ -40,10 +82,59 @@ void sched_unblock_all(struct list_head *wait_head, volatile spinlock_t *_Nullab
 
 void sched_yield(void);
 
+/* sets task's policy, and for fifo and rr its rt_prio in [0, RT_PRIO_LEVELS). only for the current
+   task, which switches class the next time it's preempted, or one that hasn't been readied yet.
+   a deadline task gives back its bandwidth. returns -1 on bad arguments or any other task. */
+int sched_set_policy(struct task *task, uint32_t policy, int32_t rt_prio);
+
+/* a group of tasks that competes with the other tasks and groups at its level as a single entity
+   of the given weight on each cpu, and whose share is then split among its own members by
+   theirs. parent NULL is the top level. groups are never freed. returns NULL for a weight of 0
+   or if out of memory. */
+struct task_group *sched_create_group(struct task_group *_Nullable parent, uint32_t weight);
+
+// moves task into group (NULL for the top level). same restrictions as sched_set_policy.
+int sched_set_group(struct task *task, struct task_group *_Nullable group);
+
+/* makes task a deadline task that runs for up to runtime_us out of every period_us, and is done
+   within deadline_us of each period starting (runtime_us <= deadline_us <= period_us). it's
+   admitted to the least utilized cpu it's allowed on (only this one for the current task) and
+   stays there, as long as that keeps the cpu under SCHED_DL_UTIL_MAX_PERCENT. a task that
+   overruns its runtime is throttled until its next period. same restrictions as
+   sched_set_policy, and the task mustn't be a deadline task already. returns -1 if it can't be
+   admitted. */
+int sched_set_deadline(struct task *task, uint64_t runtime_us, uint64_t deadline_us,
+                       uint64_t period_us);
+
+/* where a waking or new task should be queued: its previous cpu if its affinity allows it and
+   that cpu isn't much busier than the rest, otherwise the least loaded cpu it's allowed on.
+   deadline tasks always go back to the cpu they were admitted to. */
+cpu_t select_task_cpu(struct task *task);
+
+// makes this cpu's run queue visible to the balancer. call once per cpu before it schedules.
+void sched_init_cpu(void);
+
+// pulls tasks from the busiest cpu's run queue if it's carrying more load than ours. irqs must be
+// masked.
+void sched_balance(void);
+
+/* called at the end of an interrupt: if this cpu is idle, it goes looking for work, if a woken task
+   should preempt the running one, it does, and if the cpu had stopped its tick for a lone task
+   that now has company, the tick restarts. */
+void sched_kicked(void);
+
+// the length of the current task's slice, in timer counts.
+uint32_t sched_slice(void);
+
+// whether this cpu needs its tick: not while it's idle, or running its only task on a nohz_full
+// cpu.
+bool sched_tick_needed(void);
+
+// prints how often each cpu, finding its run queue empty, managed to steal a task.
+void sched_report(void);
+
 void sched_preempt_disable(void);
 void sched_preempt_enable(void);
 bool can_preempt(void);
 
-time_t get_min_vruntime(void);
-
 #endif
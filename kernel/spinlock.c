@@ -35,6 +35,24 @@ void spin_lock_irq(volatile spinlock_t *lock) {
     lock->masked_val = masked_val;
 }
 
+bool spin_trylock_irq(volatile spinlock_t *lock) {
+    uint8_t expected = UNLOCKED;
+
+    bool masked_val = irqs_masked();
+    mask_irqs();
+
+    if (!__atomic_compare_exchange_n(&lock->flag, &expected, LOCKED, false, __ATOMIC_ACQUIRE,
+                                     __ATOMIC_RELAXED)) {
+        restore_irq_mask(masked_val);
+        return false;
+    }
+
+    lock->holder = this_cpu();
+    lock->masked_val = masked_val;
+
+    return true;
+}
+
 void spin_unlock_irq(volatile spinlock_t *lock) {
     cpu_t holder = lock->holder;
     if (holder != this_cpu()) {
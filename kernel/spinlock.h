@@ -8,4 +8,7 @@ void spin_lock_init(volatile spinlock_t *lock);
 void spin_lock_irq(volatile spinlock_t *lock);
 void spin_unlock_irq(volatile spinlock_t *lock);
 
+// takes the lock (masking irqs, like spin_lock_irq) only if that doesn't mean waiting.
+bool spin_trylock_irq(volatile spinlock_t *lock);
+
 #endif
@@ -1,6 +1,7 @@
 #include "task.h"
 #include "die.h"
 #include "kmalloc.h"
+#include "kstack.h"
 #include "memory.h"
 #include "kconsole.h"
 #include "pltfrm.h"
@@ -11,15 +12,26 @@ struct task *__pcpu_current_task PERCPU_UNINIT;
 struct task *create_task(void) {
     struct task *task = kmalloc(sizeof(*task));
     task->preempt_counter = 0;
+    task->prio = 0;
+    task->policy = SCHED_POLICY_NORMAL;
+    task->rt_prio = 0;
+    task->group = NULL;
+    task->cpu = CPU_INVALID;
+    cpu_affinity_set_all(&task->affinity);
     task->runtime = 0;
-    task->vruntime = get_min_vruntime(); // This can be set to 0.
+    // starts level with whatever queue it goes in first.
+    task->sched_node.se.vruntime = 0;
+    task->sched_node.se.on_rq = false;
+    task->sched_node.se.cfs_rq = NULL;
+    task->sched_node.se.my_q = NULL;
     task->user_stack_base = 0;
-    task->kernel_stack_base = (uintptr_t) kmalloc(KSTACK_SIZE);
+    task->kernel_stack_base = kstack_alloc();
 
     ctdn_latch_set(&task->ref_cnt, 1);
     task->mm = NULL;
     __atomic_store_n(&task->pin_count, 0, __ATOMIC_RELEASE);
     __atomic_store_n(&task->migrate_lock, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&task->on_cpu, false, __ATOMIC_RELEASE);
 
     list_init(&task->wait_list);
     spin_lock_init(&task->wait_list_lock);
@@ -32,7 +44,7 @@ struct task *create_task(void) {
 }
 
 void free_task(struct task *task) {
-    kfree((void *)task->kernel_stack_base);
+    kstack_free(task->kernel_stack_base);
     kfree(task);
 }
 
@@ -44,16 +56,23 @@ static const uint32_t prio_to_weight[40] = {
     110,   87,    70,    56,    45,    36,    29,    23,    18,    15     // 10..19
 };
 
+uint32_t task_weight(prio_t prio) {
+    return prio_to_weight[KMAX(KMIN(prio, 19), -20) + 20];
+}
+
 static void update_runtime_values(volatile struct task *task) {
     time_t current = timer_get_phys();
 
     time_t delta = current - task->state_begin;
 
-    prio_t prio = KMAX(KMIN(task->prio, 19), -20);
-    time_t vdelta = (delta * prio_to_weight[20]) / prio_to_weight[prio + 20];
+    time_t vdelta = (delta * task_weight(0)) / task_weight(task->prio);
 
     task->runtime += delta;
-    task->vruntime += vdelta;
+    task->sched_node.se.vruntime += vdelta;
+
+    if (task->policy == SCHED_POLICY_DEADLINE) {
+        task->sched_node.dl_budget -= KMIN(delta, task->sched_node.dl_budget);
+    }
 }
 
 // Non-reentrant
@@ -80,11 +99,15 @@ task_state_t get_state(volatile struct task *task) {
 }
 
 bool task_pin(volatile struct task *task) {
-    if (__atomic_load_n(&task->migrate_lock, __ATOMIC_ACQUIRE) == 0) {
-        __atomic_fetch_add(&task->pin_count, 1, __ATOMIC_RELAXED);
+    // pin first and check second: either begin_migration sees our pin, or we see its lock. the
+    // other way around, both could go ahead.
+    __atomic_fetch_add(&task->pin_count, 1, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&task->migrate_lock, __ATOMIC_SEQ_CST) == 0) {
         return true;
     }
 
+    task_unpin(task);
     return false;
 }
 
@@ -99,27 +122,49 @@ void task_unpin(volatile struct task *task) {
 
 void begin_migration(struct task *task) {
     uint32_t expected = 0;
-    if (!__atomic_compare_exchange_n(&task->migrate_lock, &expected, 1, false, __ATOMIC_ACQ_REL,
+    if (!__atomic_compare_exchange_n(&task->migrate_lock, &expected, 1, false, __ATOMIC_SEQ_CST,
                                      __ATOMIC_RELAXED)) {
         return;
     }
 
-    while (__atomic_load_n(&task->pin_count, __ATOMIC_ACQUIRE) != 0) {
+    while (__atomic_load_n(&task->pin_count, __ATOMIC_SEQ_CST) != 0) {
         cpu_idle_wait(&task->pin_count);
     }
 }
 
+bool try_begin_migration(struct task *task) {
+    uint32_t expected = 0;
+    if (!__atomic_compare_exchange_n(&task->migrate_lock, &expected, 1, false, __ATOMIC_SEQ_CST,
+                                     __ATOMIC_RELAXED)) {
+        return false;
+    }
+
+    if (__atomic_load_n(&task->pin_count, __ATOMIC_SEQ_CST) != 0) {
+        end_migration(task);
+        return false;
+    }
+
+    return true;
+}
+
 void end_migration(struct task *task) {
     __atomic_store_n(&task->migrate_lock, 0, __ATOMIC_RELEASE);
     cpu_signal_all(&task->pin_count);
 }
 
-static uintptr_t duplicate_kernel_stack(void) {
-    void *ptr = kmalloc(KSTACK_SIZE);
+// only the mapped part of a stack is in use, so that's all we copy: its top 'pages' pages.
+static void copy_used_stack(uintptr_t dst_top, uintptr_t src_base, size_t pages) {
+    size_t used = pages * PAGE_SIZE;
+    copy_memory((void *)(dst_top - used), (void *)(src_base + KSTACK_SIZE - used), used);
+}
 
-    copy_memory(ptr, (void *)current_task->kernel_stack_base, KSTACK_SIZE);
+static void duplicate_kernel_stack(uintptr_t dst) {
+    // counted once: populating may grow our own stack, and the copy must not go past what was
+    // mapped for it.
+    size_t used = kstack_used_pages(current_task->kernel_stack_base);
 
-    return (uintptr_t) ptr;
+    kstack_populate(dst, used);
+    copy_used_stack(dst + KSTACK_SIZE, current_task->kernel_stack_base, used);
 }
 
 struct task *clone_current(void) {
@@ -127,16 +172,20 @@ struct task *clone_current(void) {
 
     struct task *new_task = create_task();
 
-    uintptr_t new_stack_base = duplicate_kernel_stack();
+    // create_task already gave the new task a stack of its own, just fill it in.
+    uintptr_t new_stack_base = new_task->kernel_stack_base;
     uintptr_t old_stack_base = current_task->kernel_stack_base;
 
-    new_task->kernel_stack_base = new_stack_base;
+    duplicate_kernel_stack(new_stack_base);
 
     copy_memory(&new_task->affinity, &current_task->affinity, sizeof(cpu_affinity_t));
 
     new_task->prio = current_task->prio;
-
-    sched_ready_task_local(new_task);
+    // deadline bandwidth isn't inherited, the child would have to be admitted on its own.
+    new_task->policy = current_task->policy == SCHED_POLICY_DEADLINE ? SCHED_POLICY_NORMAL
+                                                                     : current_task->policy;
+    new_task->rt_prio = current_task->rt_prio;
+    new_task->group = current_task->group;
 
     save_context_no_switch(new_task, old_stack_base, new_stack_base);
     // new_task will resume exactly at this moment.
@@ -145,6 +194,8 @@ struct task *clone_current(void) {
         // don't sched_preempt_enable here, our preempt_counter is 0 cause we're fresh.
         new_task = NULL; // Make it easy to distinguish between the parent and child task.
     } else {
+        // only now that its registers are saved may it run, on this cpu or any other.
+        sched_ready_task_local(new_task);
         sched_preempt_enable();
     }
 
@@ -154,6 +205,9 @@ struct task *clone_current(void) {
 PERCPU_UNINIT uintptr_t __pcpu_cpu_stacks[MAX_CPUS];
 
 void task_exit(status_t exit_status) {
+    // gives back any deadline bandwidth it was admitted with.
+    sched_set_policy(current_task, SCHED_POLICY_NORMAL, 0);
+
     sched_preempt_disable();
 
     current_task->exit_status = exit_status;
@@ -171,7 +225,8 @@ void task_exit(status_t exit_status) {
     update_state(current_task, TASK_STATE_TERMINATED);
 
     mask_irqs();
-    copy_memory((void *) (cpu_stacks[this_cpu()] - KSTACK_SIZE), (void *)current_task->kernel_stack_base, KSTACK_SIZE);
+    copy_used_stack(cpu_stacks[this_cpu()], current_task->kernel_stack_base,
+                    kstack_used_pages(current_task->kernel_stack_base));
     swap_stack(current_task->kernel_stack_base, (uintptr_t)cpu_stacks[this_cpu()] - KSTACK_SIZE);
 
     struct task *the_task = current_task;
@@ -29,6 +29,14 @@ struct task {
 
     task_state_t state;
     prio_t prio;
+
+    // SCHED_POLICY_*, and the priority among rt tasks (higher runs first). see sched_set_policy.
+    uint32_t policy;
+    prio_t rt_prio;
+
+    // the group it shares the cpu within as a normal task, NULL for the top level.
+    struct task_group *group;
+
     id_t tid;
 
     // WARNING: Every time you share a struct task * (i.e., give a reference to someone outside of the current context),
@@ -54,10 +62,14 @@ struct task {
     uint32_t pin_count;
     uint32_t migrate_lock;
 
+    // atomic. set from when the task starts running until its registers are back in cpu_regs. a
+    // yielding task is queued before that, and mustn't be migrated until then.
+    bool on_cpu;
+
     struct mm_info *mm;
 
     struct sched_node sched_node;
-    time_t runtime, vruntime;
+    time_t runtime;
     time_t state_begin;
 };
 
@@ -79,8 +91,13 @@ void guarantee_task_pin(volatile struct task *task);
 void task_unpin(volatile struct task *task);
 
 void begin_migration(struct task *task);
+// like begin_migration, but gives up instead of waiting if the task is pinned.
+bool try_begin_migration(struct task *task);
 void end_migration(struct task *task);
 
+// the load weight of a task at 'prio' (a nice value, clamped to [-20, 19]).
+uint32_t task_weight(prio_t prio);
+
 // returns NULL in the child task.
 struct task *clone_current(void);
 
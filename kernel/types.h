@@ -29,8 +29,17 @@ struct page {
      * allocated = 1*/
     /* if this page is allocated in an order 1 block (i.e., in a pair of pages), allocated = 2 */
     uint64_t allocated;
+
+    /* PAGE_FLAG_* */
+    uint32_t flags;
+
+    /* with PAGE_FLAG_TABLE, the number of valid entries in the translation table held in this page */
+    uint32_t table_live;
 };
 
+/* the page holds a translation table that vmap allocated and may free again */
+#define PAGE_FLAG_TABLE 0x1
+
 /*
    Structure of the memory map:
 
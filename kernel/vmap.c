@@ -1,36 +1,262 @@
 #include "vmap.h"
+#include "kmalloc.h"
 #include "kvmalloc.h"
+#include "list.h"
+#include "macros.h"
 #include "pltfrm.h"
 #include "prot.h"
+#include "sched.h"
+#include "spinlock.h"
 
-int vmap_range(uintptr_t start_va, uintptr_t start_pa, size_t pages, uint64_t prot, memory_type_t memory_type, int flags) {
-    for (size_t i = 0; i < pages; i++) {
-        int r = vmap(start_va + i * PAGE_SIZE, start_pa + i * PAGE_SIZE, prot, memory_type, flags);
-        if (r < 0) {
-            return r;
+// a device window mapped by ioremap, shared by everyone who asks for (part of) it.
+struct io_mapping {
+    struct list_head node;
+
+    // what kvmalloc gave us, which may be larger than the window to make room for alignment.
+    void *reservation;
+
+    uintptr_t va, pa;
+    size_t pages;
+    uint32_t refs;
+
+    /* set once a wider window took over its range. it stays mapped for whoever still has it, but
+       find_by_pa no longer hands it out, so live windows never overlap. */
+    bool retired;
+};
+
+static LIST_HEAD(io_mappings);
+static volatile spinlock_t io_lock;
+
+// WARNING: io_lock must be held.
+static struct io_mapping *find_by_pa(uintptr_t pa, size_t pages) {
+    LIST_FOREACH(&io_mappings, node) {
+        struct io_mapping *m = LIST_ELEMENT(node, struct io_mapping, node);
+
+        if (!m->retired && m->pa <= pa &&
+            pa + pages * PAGE_SIZE <= m->pa + m->pages * PAGE_SIZE) {
+            return m;
         }
     }
 
-    return 0;
+    return NULL;
 }
 
-int vumap_range(uintptr_t start_va, size_t pages) {
-    for (size_t i = 0; i < pages; i++) {
-        int r = vumap(start_va + i * PAGE_SIZE);
+/* grows [*start, *end) until it takes in every live window it overlaps, giving the range a window
+   must cover to replace them all rather than alias part of one.
+   WARNING: io_lock must be held. */
+static void cover_overlaps(uintptr_t *start, uintptr_t *end) {
+    bool grew = true;
+
+    // taking in one window can make us overlap another.
+    while (grew) {
+        grew = false;
+
+        LIST_FOREACH(&io_mappings, node) {
+            struct io_mapping *m = LIST_ELEMENT(node, struct io_mapping, node);
+            uintptr_t m_end = m->pa + m->pages * PAGE_SIZE;
+
+            if (m->retired || m_end <= *start || *end <= m->pa) {
+                continue;
+            }
+
+            if (m->pa < *start) {
+                *start = m->pa;
+                grew = true;
+            }
+
+            if (m_end > *end) {
+                *end = m_end;
+                grew = true;
+            }
+        }
+    }
+}
+
+// retires every live window inside [start, end), now that one covering all of it is going in.
+// WARNING: io_lock must be held.
+static void retire_covered(uintptr_t start, uintptr_t end) {
+    LIST_FOREACH(&io_mappings, node) {
+        struct io_mapping *m = LIST_ELEMENT(node, struct io_mapping, node);
+
+        if (start <= m->pa && m->pa + m->pages * PAGE_SIZE <= end) {
+            m->retired = true;
+        }
+    }
+}
+
+// WARNING: io_lock must be held.
+static struct io_mapping *find_by_va(uintptr_t va) {
+    LIST_FOREACH(&io_mappings, node) {
+        struct io_mapping *m = LIST_ELEMENT(node, struct io_mapping, node);
+
+        if (m->va <= va && va < m->va + m->pages * PAGE_SIZE) {
+            return m;
+        }
+    }
+
+    return NULL;
+}
+
+/* maps [pa, pa + pages) at va a piece at a time, each small enough for vmap_prepare to cover. the
+   pieces end on block boundaries, so they don't cost vmap_range any block descriptors. */
+static int map_chunks(uintptr_t va, uintptr_t pa, size_t pages) {
+    const uintptr_t chunk_size = VMAP_PREPARE_MAX_PAGES * PAGE_SIZE;
+
+    for (size_t done = 0; done < pages;) {
+        uintptr_t chunk_va = va + done * PAGE_SIZE;
+        size_t chunk = KMIN(pages - done, (chunk_size - (chunk_va & (chunk_size - 1))) / PAGE_SIZE);
+
+        // the tables come out of this cpu's reserve, so stay on it until they're in.
+        sched_preempt_disable();
+
+        int r = vmap_prepare(chunk_va, chunk);
+        if (r >= 0) {
+            r = vmap_range(chunk_va, pa + done * PAGE_SIZE, chunk, PROT_RSYS | PROT_WSYS,
+                           MEMORY_TYPE_DEVICE_STRICT, 0);
+        }
+
+        sched_preempt_enable();
+
         if (r < 0) {
             return r;
         }
+
+        done += chunk;
     }
 
     return 0;
 }
 
+/* maps a new window, not yet on io_mappings. it allocates and maps, so it must be called without
+   io_lock held. */
+static struct io_mapping *map_window(uintptr_t pa, size_t pages) {
+    struct io_mapping *m = kmalloc(sizeof(*m));
+    if (!m) return NULL;
+
+    // a window of a block or more gets a va with the same offset into a block as its pa, so that
+    // vmap_range can use block descriptors for it.
+    size_t slack = pages * PAGE_SIZE >= HUGE_PAGE_SIZE ? HUGE_PAGE_SIZE / PAGE_SIZE - 1 : 0;
+
+    m->reservation = kvmalloc(pages + slack, 0);
+    if (!m->reservation) {
+        kfree(m);
+        return NULL;
+    }
+
+    uintptr_t va = (uintptr_t)m->reservation;
+    if (slack) {
+        va += (pa - va) & (HUGE_PAGE_SIZE - 1);
+    }
+
+    if (map_chunks(va, pa, pages) < 0) {
+        vumap_range(va, pages);
+        kvfree(m->reservation);
+        kfree(m);
+        return NULL;
+    }
+
+    m->va = va;
+    m->pa = pa;
+    m->pages = pages;
+    m->refs = 0;
+    m->retired = false;
+
+    return m;
+}
+
+/* undoes map_window, once m is off io_mappings. must be called without io_lock held. there are
+   no pages behind a device window to give back, so the tlb can be left for kvfree_lazy to flush in
+   a batch: the range isn't handed out again until it has been. */
+static void unmap_window(struct io_mapping *m) {
+    // from the start of the reservation, the alignment slack before the window isn't mapped.
+    kvfree_lazy(m->reservation, (m->va - (uintptr_t)m->reservation) / PAGE_SIZE + m->pages);
+    kfree(m);
+}
+
 void *ioremap(uintptr_t start_pa, size_t bytes) {
-    size_t pages = (bytes + PAGE_SIZE - 1) / PAGE_SIZE;
-    void *ptr = kvmalloc(pages, 0);
-    if (!ptr) return NULL;
+    uintptr_t pa = start_pa & ~(uintptr_t)(PAGE_SIZE - 1);
+    size_t pages = (start_pa + bytes - pa + PAGE_SIZE - 1) / PAGE_SIZE;
+
+    spin_lock_irq(&io_lock);
+
+    struct io_mapping *m = find_by_pa(pa, pages);
+    struct io_mapping *fresh = NULL;
+
+    while (!m) {
+        // a range that only partly overlaps a window gets a new one covering both, which takes
+        // over from the old one. mapping the rest on its own would alias the shared pages.
+        uintptr_t start = pa, end = pa + pages * PAGE_SIZE;
+        cover_overlaps(&start, &end);
+
+        spin_unlock_irq(&io_lock);
+
+        if (fresh) {
+            unmap_window(fresh);
+        }
+
+        fresh = map_window(start, (end - start) / PAGE_SIZE);
+        if (!fresh) {
+            return NULL;
+        }
+
+        spin_lock_irq(&io_lock);
+
+        // someone may have mapped it while we weren't looking, in which case theirs wins. if they
+        // mapped something that overlaps ours instead, ours no longer covers it: go around again.
+        m = find_by_pa(pa, pages);
+        if (m) {
+            break;
+        }
+
+        uintptr_t new_start = start, new_end = end;
+        cover_overlaps(&new_start, &new_end);
+
+        if (new_start == start && new_end == end) {
+            retire_covered(start, end);
+            list_add_tail(&fresh->node, &io_mappings);
+            m = fresh;
+            fresh = NULL;
+        }
+    }
+
+    m->refs++;
+    void *ptr = (void *)(m->va + (start_pa - m->pa));
+
+    spin_unlock_irq(&io_lock);
+
+    if (fresh) {
+        unmap_window(fresh);
+    }
+
+    return ptr;
+}
+
+void iounmap(void *ptr) {
+    spin_lock_irq(&io_lock);
+
+    struct io_mapping *m = find_by_va((uintptr_t)ptr);
+    if (!m || --m->refs) {
+        spin_unlock_irq(&io_lock);
+        return;
+    }
+
+    list_del(&m->node);
+    spin_unlock_irq(&io_lock);
+
+    unmap_window(m);
+}
+
+void *ioremap_lookup(uintptr_t pa) {
+    void *ptr = NULL;
+
+    spin_lock_irq(&io_lock);
+
+    struct io_mapping *m = find_by_pa(pa & ~(uintptr_t)(PAGE_SIZE - 1), 1);
+    if (m) {
+        ptr = (void *)(m->va + (pa - m->pa));
+    }
 
-    if (vmap_range((uintptr_t) ptr, start_pa, pages, PROT_RSYS | PROT_WSYS, MEMORY_TYPE_DEVICE_STRICT, 0) < 0) return NULL;
+    spin_unlock_irq(&io_lock);
 
     return ptr;
 }
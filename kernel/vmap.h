@@ -7,8 +7,17 @@
 #define VMAP_ERROR_INVALID_PROT -1
 #define VMAP_ERROR_TABLE_NOMEM -2
 #define VMAP_ERROR_ALREADY_MAPPED -3
+#define VMAP_ERROR_NOT_RESERVED -4
+#define VMAP_ERROR_PREPARE_TOO_BIG -5
 
 #define VMAP_FLAG_REMAP 0x1
+// don't invalidate the tlb for the new mapping, the caller will. the entries are still made
+// visible to the table walker before vmap returns, so the mapping can be used right away.
+#define VMAP_FLAG_NO_FLUSH 0x2
+/* the mapping will only ever be used by this cpu, so its tlb maintenance (here and when it's
+   unmapped) stays local instead of being broadcast. the caller must keep it that way, e.g. by
+   not being preempted or migrated while it's mapped. */
+#define VMAP_FLAG_PRIVATE 0x4
 
 #define VUMAP_ERROR_NOT_MAPPED -1
 
@@ -16,13 +25,57 @@
 int vmap(uintptr_t va, uintptr_t pa, uint64_t prot, memory_type_t memory_type, int flags);
 int vumap(uintptr_t va);
 
+// like vumap, but leaves the tlb alone. the caller must flush before the address is reused.
+int vumap_noflush(uintptr_t va);
+
 int vmap_range(uintptr_t start_va, uintptr_t start_pa, size_t pages, uint64_t prot, memory_type_t memory_type, int flags);
+
+/* tops up this cpu's reserve of zeroed page-table pages so that mapping [va, va + pages) right
+   after needn't allocate. call it before taking any locks, and don't leave the cpu until the
+   mapping is done (hold sched_preempt_disable across both), since the reserve stays behind.
+   returns 0, VMAP_ERROR_TABLE_NOMEM, or VMAP_ERROR_PREPARE_TOO_BIG if the range could need more
+   tables than the reserve holds. VMAP_PREPARE_MAX_PAGES pages, from anywhere, never do. */
+int vmap_prepare(uintptr_t va, size_t pages);
+
+/* sets aside the unmapped pages of [va, va + pages) for vmap_fault_in: their tables are created
+   now and kept alive until the pages are unmapped with vumap/vumap_range. */
+int vmap_reserve(uintptr_t va, size_t pages);
+
+/* maps a page that vmap_reserve set aside, without allocating or taking any locks, so it's safe
+   from a fault handler no matter what was interrupted. returns VMAP_ERROR_NOT_RESERVED if va wasn't
+   reserved (or is already mapped). */
+int vmap_fault_in(uintptr_t va, uintptr_t pa, uint64_t prot, memory_type_t memory_type);
+// unmaps every mapped page in the range. returns VUMAP_ERROR_NOT_MAPPED if some pages weren't.
 int vumap_range(uintptr_t start_va, size_t pages);
+int vumap_range_noflush(uintptr_t start_va, size_t pages);
 
+/* maps the device window [start_pa, start_pa + bytes) and returns the address of start_pa in it.
+   a window that an earlier ioremap already covers is shared rather than mapped again, and one that
+   partly overlaps an earlier window is mapped together with it, so new callers never get two
+   addresses for the same device page. every ioremap must be matched by an iounmap. */
 void *ioremap(uintptr_t start_pa, size_t bytes);
+void iounmap(void *ptr);
+
+// returns where ioremap has pa mapped, or NULL. doesn't take a reference.
+void *ioremap_lookup(uintptr_t pa);
 
 uintptr_t get_phys_mapping(uintptr_t va);
 
 void enable_global_tlb_invalidate(void);
 
+// invalidates every EL1 tlb entry on every cpu.
+void tlb_flush(void);
+
+// invalidates the entries for 'pages' pages starting at va on every cpu, with a single barrier
+// sequence.
+void tlb_flush_range(uintptr_t va, size_t pages);
+
+// like tlb_flush_range and tlb_flush_addr, for this cpu only.
+void tlb_flush_range_local(uintptr_t va, size_t pages);
+void tlb_flush_addr_local(uintptr_t va);
+
+// invalidates va on every cpu, including any cached walk entries for it. a nonzero level is a hint
+// giving the level of the leaf entry that mapped va; pass 0 when unknown or when a table went away.
+void tlb_flush_addr_level(uintptr_t va, int level);
+
 #endif